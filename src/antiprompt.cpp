@@ -0,0 +1,99 @@
+#include "antiprompt.h"
+
+#include <queue>
+
+
+// builds the automaton, each pattern is identified by its index in patterns
+void AntipromptMatcher::Build(const std::vector<std::string> &patterns) {
+    this->patterns = patterns;
+    this->nodes.assign(1, Node());
+    this->nodes[0].next.fill(-1);
+
+    // 1. build trie
+    for (size_t i = 0; i < patterns.size(); i++) {
+        int node = 0;
+        for (unsigned char c : patterns[i]) {
+            if (this->nodes[node].next[c] < 0) {
+                this->nodes[node].next[c] = this->nodes.size();
+                Node new_node;
+                new_node.next.fill(-1);
+                new_node.depth = this->nodes[node].depth + 1;
+                this->nodes.push_back(new_node);
+            }
+            node = this->nodes[node].next[c];
+        }
+        // ignore empty patterns and keep the first one of duplicates
+        if (node != 0 && this->nodes[node].match < 0)
+            this->nodes[node].match = i;
+    }
+
+    // 2. compute failure links breadth first and turn the trie into a DFA
+    std::queue<int> queue;
+    for (int c = 0; c < 256; c++) {
+        int child = this->nodes[0].next[c];
+        if (child < 0) {
+            this->nodes[0].next[c] = 0;
+        } else {
+            this->nodes[child].fail = 0;
+            queue.push(child);
+        }
+    }
+
+    while (!queue.empty()) {
+        int node = queue.front();
+        queue.pop();
+
+        // inherit match from the failure link if this node doesn't complete a pattern
+        int fail = this->nodes[node].fail;
+        if (this->nodes[node].match < 0)
+            this->nodes[node].match = this->nodes[fail].match;
+
+        for (int c = 0; c < 256; c++) {
+            int child = this->nodes[node].next[c];
+            if (child < 0) {
+                this->nodes[node].next[c] = this->nodes[fail].next[c];
+            } else {
+                this->nodes[child].fail = this->nodes[fail].next[c];
+                queue.push(child);
+            }
+        }
+    }
+
+    this->state = 0;
+}
+
+
+// forgets all output fed so far
+void AntipromptMatcher::Reset(void) {
+    this->state = 0;
+}
+
+
+int AntipromptMatcher::Feed(char c) {
+    if (this->nodes.empty())
+        return -1;
+    this->state = this->nodes[this->state].next[(unsigned char) c];
+    return this->nodes[this->state].match;
+}
+
+
+size_t AntipromptMatcher::GetDepth(void) const {
+    if (this->nodes.empty())
+        return 0;
+    return this->nodes[this->state].depth;
+}
+
+
+size_t AntipromptMatcher::GetLength(int pattern) const {
+    return this->patterns.at(pattern).length();
+}
+
+
+const std::string &AntipromptMatcher::GetPattern(int pattern) const {
+    return this->patterns.at(pattern);
+}
+
+
+bool AntipromptMatcher::Empty(void) const {
+    return this->nodes.size() <= 1;
+}
@@ -0,0 +1,39 @@
+#ifndef ANTIPROMPT_H
+#define ANTIPROMPT_H
+
+#include <array>
+#include <string>
+#include <vector>
+
+/**
+ * Streaming multi-pattern matcher for reverse prompts (Aho-Corasick automaton over bytes).
+ * Output is fed as it's generated and each byte costs O(1) regardless of the number of
+ * antiprompts or the length of the output so far.
+ */
+class AntipromptMatcher {
+public:
+    void Build(const std::vector<std::string> &patterns);
+    void Reset(void);
+
+    int Feed(char c); // returns index of the matched pattern or -1
+    
+    // number of most recent bytes that form a prefix of some pattern
+    size_t GetDepth(void) const;
+    size_t GetLength(int pattern) const;
+    const std::string &GetPattern(int pattern) const;
+    bool Empty(void) const;
+
+private:
+    struct Node {
+        std::array<int, 256> next;
+        int fail = 0;
+        int match = -1; // longest pattern ending at this node
+        size_t depth = 0;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<std::string> patterns;
+    int state = 0;
+};
+
+#endif // ANTIPROMPT_H
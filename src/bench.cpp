@@ -0,0 +1,322 @@
+// Headless benchmark, runs a scripted conversation through Model without the UI
+// and reports timings as JSON. Built without wxWidgets, see "make bench".
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "config.h"
+#include "decodeengine.h"
+#include "microbench.h"
+#include "model.h"
+#include "scheduler.h"
+#include "tokensink.h"
+#include "utils.h"
+
+
+static void PrintUsage(const char *exec) {
+    std::cerr << "usage: " << exec << " <config.json> <conversation.txt> [options]\n"
+              << "       " << exec << " --micro [config.json] [-m <path>] [-t <n>] [-o <path>]\n"
+              << "  conversation.txt contains one user input per line\n"
+              << "options:\n"
+              << "  -m <path>   model file, default is model_dir/model_file from the config\n"
+              << "  -d <path>   draft model for speculative decoding, default is draft_model from the config\n"
+              << "  -t <n>      number of threads\n"
+              << "  -n <n>      max number of tokens to generate per reply\n"
+              << "  -o <path>   write results to a file instead of stdout\n"
+              << "  -j <path>   also write generated output and state changes as JSON lines\n"
+              << "  -c <n>      number of characters generating at the same time, default 1\n"
+              << "  -p          run evals of the characters in parallel instead of serially\n";
+}
+
+
+static double ToMs(CollectorSink::Clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+}
+
+
+// summary of samples: mean and nearest-rank percentiles
+static json Summarize(std::vector<double> values) {
+    if (values.size() == 0)
+        return json::object();
+
+    std::sort(values.begin(), values.end());
+    auto percentile = [&values](double p) {
+        size_t i = (size_t) std::max(0.0, p/100.0*values.size() - 1.0 + 0.5);
+        return values.at(std::min(i, values.size() - 1));
+    };
+    double sum = 0;
+    for (double v : values)
+        sum += v;
+
+    return json{
+        {"n",    values.size()},
+        {"mean", sum/values.size()},
+        {"min",  values.front()},
+        {"p50",  percentile(50)},
+        {"p90",  percentile(90)},
+        {"p99",  percentile(99)},
+        {"max",  values.back()}
+    };
+}
+
+
+// conversation of a single character, run on its own thread
+struct Session {
+    Model *model = nullptr;
+    CollectorSink collector;
+    int char_index = 0;
+    std::string prompt; // base prompt of the character
+
+    json turns = json::array();
+    int n_generated = 0;
+    int n_drafted = 0, n_accepted = 0;
+    double generation_ms = 0; // time after the first output, for the effective rate
+    double cancel_ms = -1; // how long the final stop took, -1 if the generation had finished
+    int n_generation_tokens = 0;
+    std::vector<double> first_output_ms, interval_ms, prompt_rate, gen_rate;
+};
+
+
+static void RunSession(Session *s, const std::vector<std::string> &inputs, const Config &config) {
+    std::string user = config.user_name + ":";
+    std::string character = config.char_names.at(s->char_index) + ":";
+
+    for (size_t i = 0; i < inputs.size(); i++) {
+        int n_evaluated = s->model->GetNEvaluated();
+        int n_sampled = s->model->GetNSampled();
+
+        s->collector.Clear();
+        if (i == 0) {
+            std::string prompt = s->prompt + user + " " + inputs[i] + "\n" + character;
+            s->model->StartGeneration(prompt);
+        } else { // the reply ended with the user's name
+            s->model->AddUserInput(" " + inputs[i] + "\n" + character);
+        }
+        bool finished = s->collector.WaitForReply();
+        auto t_end = CollectorSink::Clock::now();
+
+        auto times = s->collector.GetOutputTimes();
+        auto t_start = s->collector.GetStartTime();
+        int n_generated = s->model->GetNSampled() - n_sampled;
+        int n_prompt = s->model->GetNEvaluated() - n_evaluated - n_generated;
+        s->n_generated += n_generated;
+
+        json turn = {
+            {"input",            inputs[i]},
+            {"prompt_tokens",    n_prompt},
+            {"generated_tokens", n_generated},
+            {"total_ms",         ToMs(t_end - t_start)}
+        };
+
+        if (times.size() > 0) {
+            // first output includes prompt evaluation, generation is everything after it
+            double t_first = ToMs(times.front() - t_start);
+            double t_gen = ToMs(t_end - times.front());
+            turn["first_output_ms"] = t_first;
+            turn["generation_ms"] = t_gen;
+            s->first_output_ms.push_back(t_first);
+            if (t_first > 0 && n_prompt > 0)
+                s->prompt_rate.push_back(n_prompt/t_first*1000.0);
+            if (t_gen > 0 && n_generated > 1) {
+                s->gen_rate.push_back((n_generated - 1)/t_gen*1000.0);
+                s->generation_ms += t_gen;
+                s->n_generation_tokens += n_generated - 1;
+            }
+            for (size_t k = 1; k < times.size(); k++)
+                s->interval_ms.push_back(ToMs(times[k] - times[k - 1]));
+        }
+        s->turns.push_back(turn);
+
+        if (!finished) {
+            LOG_S(WARNING) << "Generation stopped after turn " << i;
+            break;
+        }
+    }
+
+    s->model->StopGeneration();
+    s->model->WaitUntilIdle();
+    s->cancel_ms = s->model->GetCancelLatency();
+    s->n_drafted = s->model->GetNDrafted();
+    s->n_accepted = s->model->GetNAccepted();
+}
+
+
+int main(int argc, char *argv[]) {
+    loguru::g_stderr_verbosity = loguru::Verbosity_OFF;
+    loguru::init(argc, argv);
+
+    if (argc >= 2 && std::string(argv[1]) == "--micro")
+        return RunMicroBenchmarks(argc, argv);
+    if (argc < 3) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    std::string model_path, draft_path, output_path, stream_path;
+    int n_threads = -1, n_predict = -1, n_sessions = 1;
+    bool parallel = false;
+    for (int i = 3; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "-p") {
+            parallel = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+        if (arg == "-m") {
+            model_path = argv[++i];
+        } else if (arg == "-d") {
+            draft_path = argv[++i];
+        } else if (arg == "-t") {
+            n_threads = std::stoi(argv[++i]);
+        } else if (arg == "-n") {
+            n_predict = std::stoi(argv[++i]);
+        } else if (arg == "-o") {
+            output_path = argv[++i];
+        } else if (arg == "-j") {
+            stream_path = argv[++i];
+        } else if (arg == "-c") {
+            n_sessions = std::max(1, std::stoi(argv[++i]));
+        } else {
+            PrintUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    Config config;
+    if (!config.ParseFile(argv[1])) {
+        std::cerr << "Error reading config: " << argv[1] << "\n";
+        return 1;
+    }
+
+    std::vector<std::string> inputs;
+    std::ifstream file(argv[2]);
+    for (std::string line; std::getline(file, line);) {
+        if (line.size() > 0)
+            inputs.push_back(line);
+    }
+    if (inputs.size() == 0) {
+        std::cerr << "No input found in: " << argv[2] << "\n";
+        return 1;
+    }
+
+    if (model_path.empty())
+        model_path = config.model_dir + "/" + config.model_file;
+    if (!draft_path.empty())
+        config.draft_model = draft_path;
+    if (!config.draft_model.empty())
+        draft_path = (std::filesystem::path(config.model_dir) / config.draft_model).string();
+    DecodeEngine::Configure(!parallel, config.decode_threads);
+    Scheduler::Start(config.scheduler_workers, n_sessions, config.max_threads);
+
+    JsonlSink *stream = nullptr;
+    if (!stream_path.empty())
+        stream = new JsonlSink(stream_path);
+
+    // characters of the config are reused if there are more sessions than characters
+    std::vector<Session *> sessions;
+    gpt_params params;
+    double load_ms = 0;
+    for (int i = 0; i < n_sessions; i++) {
+        Session *s = new Session();
+        s->char_index = i % config.n_chars;
+        params = config.gpt_parameters.at(s->char_index);
+        if (n_threads > 0)
+            params.n_threads = n_threads;
+        if (n_predict > 0)
+            params.n_predict = n_predict;
+        s->prompt = params.prompt;
+
+        s->model = new Model(&s->collector, &config, s->char_index);
+        s->model->AddSink(stream);
+        s->model->SetGPTParams(params);
+        sessions.push_back(s);
+
+        auto t_load = CollectorSink::Clock::now();
+        if (!s->model->LoadModel(model_path, draft_path)) {
+            std::cerr << "Error loading model: " << model_path << "\n";
+            return 1;
+        }
+        load_ms += ToMs(CollectorSink::Clock::now() - t_load);
+    }
+
+    DecodeEngine::ResetStats();
+    auto t_start = CollectorSink::Clock::now();
+    std::vector<std::thread> threads;
+    for (Session *s : sessions)
+        threads.push_back(std::thread(RunSession, s, std::cref(inputs), std::cref(config)));
+    for (auto &thread : threads)
+        thread.join();
+    double wall_ms = ToMs(CollectorSink::Clock::now() - t_start);
+
+    json sessions_j = json::array();
+    std::vector<double> first_output_ms, interval_ms, prompt_rate, gen_rate, cancel_ms;
+    int n_generated = 0, n_drafted = 0, n_accepted = 0, n_generation_tokens = 0;
+    double generation_ms = 0;
+    for (Session *s : sessions) {
+        sessions_j.push_back({{"char_index", s->char_index}, {"turns", s->turns}});
+        first_output_ms.insert(first_output_ms.end(), s->first_output_ms.begin(), s->first_output_ms.end());
+        interval_ms.insert(interval_ms.end(), s->interval_ms.begin(), s->interval_ms.end());
+        prompt_rate.insert(prompt_rate.end(), s->prompt_rate.begin(), s->prompt_rate.end());
+        gen_rate.insert(gen_rate.end(), s->gen_rate.begin(), s->gen_rate.end());
+        if (s->cancel_ms >= 0)
+            cancel_ms.push_back(s->cancel_ms);
+        n_generated += s->n_generated;
+        n_drafted += s->n_drafted;
+        n_accepted += s->n_accepted;
+        generation_ms += s->generation_ms;
+        n_generation_tokens += s->n_generation_tokens;
+        delete s->model;
+        delete s;
+    }
+    delete stream;
+    Scheduler::Stop();
+
+    DecodeStats stats = DecodeEngine::GetStats();
+    SchedulerStats scheduler_stats = Scheduler::GetStats();
+    json j = {
+        {"model",      model_path},
+        {"n_threads",  params.n_threads},
+        {"n_ctx",      params.n_ctx},
+        {"n_batch",    params.n_batch},
+        {"characters", n_sessions},
+        {"decode",     parallel ? "parallel" : "serial"},
+        {"draft_model", config.draft_model},
+        {"n_draft",    config.n_draft},
+        {"load_ms",    load_ms},
+        {"wall_ms",    wall_ms},
+        {"sessions",   sessions_j},
+        {"summary", {
+            {"first_output_ms",         Summarize(first_output_ms)},
+            {"output_interval_ms",      Summarize(interval_ms)},
+            {"prompt_tokens_per_s",     Summarize(prompt_rate)},
+            {"generation_tokens_per_s", Summarize(gen_rate)},
+            {"aggregate_tokens_per_s",  wall_ms > 0 ? n_generated/wall_ms*1000.0 : 0.0},
+            {"effective_tokens_per_s",  generation_ms > 0 ? n_generation_tokens/generation_ms*1000.0 : 0.0},
+            {"cancel_ms",               Summarize(cancel_ms)},
+            {"drafted_tokens",          n_drafted},
+            {"accepted_tokens",         n_accepted},
+            {"acceptance_rate",         n_drafted > 0 ? (double) n_accepted/n_drafted : 0.0},
+            {"evals",                   stats.n_evals},
+            {"eval_ms",                 stats.eval_ms},
+            {"eval_wait_ms",            stats.wait_ms},
+            {"jobs",                    scheduler_stats.n_jobs},
+            {"job_wait_ms",             scheduler_stats.wait_ms},
+            {"max_job_wait_ms",         scheduler_stats.max_wait_ms}
+        }}
+    };
+
+    if (output_path.empty()) {
+        std::cout << j.dump(2) << "\n";
+    } else if (!utils::WriteTextFile(j.dump(2), output_path)) {
+        std::cerr << "Error writing results: " << output_path << "\n";
+        return 1;
+    }
+    return 0;
+}
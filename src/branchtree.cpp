@@ -0,0 +1,184 @@
+#include "branchtree.h"
+
+
+/**
+ * Creates an empty tree
+ * @param spill_prefix path prefix for checkpoint files which don't fit into the budget
+ */
+BranchTree::BranchTree(const std::string &spill_prefix) {
+    this->spill_prefix = spill_prefix;
+    this->Clear();
+}
+
+
+BranchTree::~BranchTree() {
+    this->RemoveFiles();
+}
+
+
+// removes all nodes and creates a new root node starting at n_past_begin
+void BranchTree::Clear(int n_past_begin) {
+    this->RemoveFiles();
+    this->nodes.clear();
+    this->used = 0;
+    
+    BranchNode root;
+    root.n_past_begin = n_past_begin;
+    this->nodes.push_back(std::move(root));
+    this->current = 0;
+}
+
+
+// adds a new child to the current node and makes it current, returns its id
+int BranchTree::AddNode(const std::string &input) {
+    BranchNode node;
+    node.parent = this->current;
+    node.n_past_begin = this->nodes.at(this->current).GetNPastEnd();
+    node.input = input;
+    
+    int id = this->nodes.size();
+    this->nodes.push_back(std::move(node));
+    this->nodes.at(this->current).children.push_back(id);
+    this->current = id;
+    return id;
+}
+
+
+// records tokens evaluated after the current node
+void BranchTree::AddTokens(const llama_token *tokens, int n_tokens) {
+    auto &node = this->nodes.at(this->current);
+    node.tokens.insert(node.tokens.end(), tokens, tokens + n_tokens);
+}
+
+
+void BranchTree::AddOutput(const std::string &text) {
+    this->nodes.at(this->current).output += text;
+}
+
+
+// marks reply of the current node as finished
+void BranchTree::FinishNode(const RingBuffer<llama_token> &last_n_tokens,
+                            const std::vector<llama_token> &pending) {
+    auto &node = this->nodes.at(this->current);
+    node.last_n_tokens = last_n_tokens;
+    node.pending = pending;
+    node.finished = true;
+}
+
+
+// stores state of the context at the end of node id with KV rows of the node, the node
+// must be the current one since its rows must be in the context
+void BranchTree::SaveCheckpoint(llama_context *ctx, int id) {
+    auto &node = this->nodes.at(id);
+    if (id != this->current || node.checkpoint.IsValid() || !node.spill_path.empty())
+        return; // can't or don't need to save
+    
+    node.checkpoint.Save(ctx, node.GetNPastEnd());
+    node.checkpoint.SaveKV(ctx, node.n_past_begin);
+    node.last_used = ++this->clock;
+    this->used += node.checkpoint.GetSize();
+    this->EnforceBudget(id);
+}
+
+
+// returns checkpoint of the node loading it from the file if necessary, nullptr if none
+ContextSnapshot *BranchTree::GetCheckpoint(int id) {
+    auto &node = this->nodes.at(id);
+    
+    if (!node.spill_path.empty()) {
+        if (!node.checkpoint.ReadFile(node.spill_path)) {
+            LOG_S(ERROR) << "Error reading checkpoint: " << node.spill_path;
+            return nullptr;
+        }
+        std::filesystem::remove(node.spill_path);
+        node.spill_path.clear();
+        this->used += node.checkpoint.GetSize();
+        this->EnforceBudget(id);
+    }
+    
+    if (!node.checkpoint.IsValid())
+        return nullptr;
+    node.last_used = ++this->clock;
+    return &node.checkpoint;
+}
+
+
+BranchNode &BranchTree::GetNode(int id) {
+    return this->nodes.at(id);
+}
+
+
+int BranchTree::GetCurrent(void) {
+    return this->current;
+}
+
+
+void BranchTree::SetCurrent(int id) {
+    this->current = id;
+}
+
+
+std::vector<int> BranchTree::GetPath(int id) {
+    std::vector<int> path;
+    for (; id >= 0; id = this->nodes.at(id).parent)
+        path.insert(path.begin(), id);
+    return path;
+}
+
+
+// returns finished sibling of the node in the given direction (-1/1) or -1 if there is none
+int BranchTree::GetSibling(int id, int direction) {
+    int parent = this->nodes.at(id).parent;
+    if (parent < 0)
+        return -1;
+
+    auto &siblings = this->nodes.at(parent).children;
+    int i = std::find(siblings.begin(), siblings.end(), id) - siblings.begin();
+    for (i += direction; i >= 0 && i < (int) siblings.size(); i += direction) {
+        if (this->nodes.at(siblings.at(i)).finished)
+            return siblings.at(i);
+    }
+    return -1;
+}
+
+
+void BranchTree::SetBudget(size_t budget) {
+    this->budget = budget;
+    this->EnforceBudget(this->current);
+}
+
+
+// moves least recently used checkpoints to files until memory usage fits the budget
+void BranchTree::EnforceBudget(int keep) {
+    while (this->used > this->budget) {
+        int lru = -1;
+        for (int i = 0; i < (int) this->nodes.size(); i++) {
+            if (i == keep || !this->nodes[i].checkpoint.IsValid())
+                continue;
+            if (lru < 0 || this->nodes[i].last_used < this->nodes[lru].last_used)
+                lru = i;
+        }
+        if (lru < 0)
+            return; // nothing left to move
+        
+        auto &node = this->nodes[lru];
+        std::string path = this->spill_prefix + std::to_string(lru) + ".bin";
+        size_t size = node.checkpoint.GetSize();
+        if (node.checkpoint.WriteFile(path)) {
+            node.spill_path = path;
+        } else { // checkpoint is dropped, node will be recomputed if selected
+            LOG_S(WARNING) << "Error writing checkpoint: " << path;
+            std::filesystem::remove(path);
+        }
+        node.checkpoint.Clear();
+        this->used -= size;
+    }
+}
+
+
+void BranchTree::RemoveFiles(void) {
+    for (auto &node : this->nodes) {
+        if (!node.spill_path.empty())
+            std::filesystem::remove(node.spill_path);
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef BRANCHTREE_H
+#define BRANCHTREE_H
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include "loguru.hpp"
+
+#include "llama.h"
+
+#include "config.h"
+#include "ringbuffer.h"
+#include "snapshot.h"
+
+// A single turn of the conversation: user input and the reply generated after it
+struct BranchNode {
+    int parent = -1;
+    std::vector<int> children;
+    
+    int n_past_begin = 0; // position of the first token of this node
+    std::vector<llama_token> tokens; // tokens evaluated in this node (input and reply)
+    std::string input; // input which started this node
+    std::string output; // output sent to the UI
+    RingBuffer<llama_token> last_n_tokens; // at the end of the node
+    std::vector<llama_token> pending; // sampled tokens which weren't evaluated yet
+    bool finished = false; // reply has been generated
+    
+    ContextSnapshot checkpoint; // state at the end of the node with KV rows of the node
+    std::string spill_path; // checkpoint has been moved to this file
+    uint64_t last_used = 0;
+
+    int GetNPastEnd(void) const {
+        return this->n_past_begin + this->tokens.size();
+    }
+};
+
+
+/**
+ * Tree of conversation branches of a single Model. Regenerating a reply starts a new
+ * sibling instead of discarding the old one, and any finished node can be selected again.
+ * Checkpoints are kept in memory up to the budget, least recently used ones are moved to
+ * files after that.
+ */
+class BranchTree {
+public:
+    explicit BranchTree(const std::string &spill_prefix);
+    ~BranchTree();
+    
+    void Clear(int n_past_begin = 0);
+    int AddNode(const std::string &input);
+    void AddTokens(const llama_token *tokens, int n_tokens);
+    void AddOutput(const std::string &text);
+    void FinishNode(const RingBuffer<llama_token> &last_n_tokens,
+                    const std::vector<llama_token> &pending);
+    
+    void SaveCheckpoint(llama_context *ctx, int id);
+    ContextSnapshot *GetCheckpoint(int id);
+    
+    BranchNode &GetNode(int id);
+    int GetCurrent(void);
+    void SetCurrent(int id);
+    std::vector<int> GetPath(int id); // from root to id
+    int GetSibling(int id, int direction);
+    
+    void SetBudget(size_t budget);
+
+private:
+    void EnforceBudget(int keep);
+    void RemoveFiles(void);
+
+    std::vector<BranchNode> nodes;
+    int current = -1;
+    size_t budget = (size_t) DEFAULT_CHECKPOINT_BUDGET*1024*1024; // bytes
+    size_t used = 0; // bytes used by checkpoints in memory
+    uint64_t clock = 0;
+    std::string spill_prefix;
+};
+
+#endif // BRANCHTREE_H
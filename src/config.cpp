@@ -53,12 +53,24 @@ bool Config::ParseJSON(std::string input) {
     this->user_avatar       = j.value("user_avatar", DEFAULT_USER_AVATAR);
     this->model_dir         = j.value("model_dir", DEFAULT_MODEL_DIR);
     this->model_file        = j.value("model_file", DEFAULT_MODEL_FILE);
+    this->draft_model       = j.value("draft_model", "");
+    this->n_draft           = j.value("n_draft", DEFAULT_N_DRAFT);
     this->avatar_dir        = j.value("avatar_dir", DEFAULT_AVATAR_DIR);
         
     this->prompt_path       = j.value("prompt_path", std::vector<std::string>({DEFAULT_PROMPT_PATH}));
     this->ui_dir            = j.value("ui_dir", DEFAULT_UI_DIR);
     this->ui_style          = j.value("ui_style", DEFAULT_UI_STYLE);
     this->userscripts_dir   = j.value("userscripts_dir", DEFAULT_USERSCRIPTS_DIR);
+    this->ui_flush_interval = j.value("ui_flush_interval", DEFAULT_UI_FLUSH_INTERVAL);
+    this->checkpoint_budget = j.value("checkpoint_budget", DEFAULT_CHECKPOINT_BUDGET);
+    this->prompt_cache_dir  = j.value("prompt_cache_dir", DEFAULT_PROMPT_CACHE_DIR);
+    
+    this->shared_context    = j.value("shared_context", false);
+    this->serial_decode     = j.value("serial_decode", true);
+    this->decode_threads    = j.value("decode_threads", 0);
+    this->eval_chunk_ms     = j.value("eval_chunk_ms", DEFAULT_EVAL_CHUNK_MS);
+    this->max_threads       = j.value("max_threads", 0);
+    this->scheduler_workers = j.value("scheduler_workers", 0);
     
     if (j.contains("n_chars"))
         this->n_chars = j["n_chars"].get<int>();
@@ -108,17 +120,28 @@ void to_json(json& j, const Config& cfg) {
         {"auto_n_keep",     cfg.auto_n_keep},
         {"char_names",      cfg.char_names},
         {"char_avatars",    cfg.char_avatars},
+        {"checkpoint_budget", cfg.checkpoint_budget},
         {"config_dir",      cfg.config_dir},
         {"user_name",       cfg.user_name},
         {"user_avatar",     cfg.user_avatar},
         {"model_dir",       cfg.model_dir},
         {"model_file",      cfg.model_file},
+        {"draft_model",     cfg.draft_model},
+        {"n_draft",         cfg.n_draft},
         {"avatar_dir",      cfg.avatar_dir},
         {"prompt_path",     cfg.prompt_path},
+        {"prompt_cache_dir", cfg.prompt_cache_dir},
         {"ui_dir",          cfg.ui_dir},
         {"ui_style",        cfg.ui_style},
         {"userscripts_dir", cfg.userscripts_dir},
+        {"ui_flush_interval", cfg.ui_flush_interval},
         {"n_chars",         cfg.n_chars},
+        {"shared_context",  cfg.shared_context},
+        {"serial_decode",   cfg.serial_decode},
+        {"decode_threads",  cfg.decode_threads},
+        {"eval_chunk_ms",   cfg.eval_chunk_ms},
+        {"max_threads",     cfg.max_threads},
+        {"scheduler_workers", cfg.scheduler_workers},
         {"gpt_params",      cfg.gpt_parameters}
     };
 }
@@ -22,6 +22,12 @@ using json = nlohmann::json;
 #define DEFAULT_UI_DIR          "ui/"
 #define DEFAULT_UI_STYLE        "default"
 #define DEFAULT_USERSCRIPTS_DIR "userscripts/"
+#define DEFAULT_UI_FLUSH_INTERVAL 16 // ms
+#define DEFAULT_CHECKPOINT_BUDGET 1024 // MB
+#define DEFAULT_PROMPT_CACHE_DIR "cache/"
+#define DEFAULT_N_DRAFT         4 // tokens proposed by the draft model at a time
+#define DEFAULT_PREFILL_BATCH   32 // tokens per background eval, delays of the current speaker stay short
+#define DEFAULT_EVAL_CHUNK_MS   100 // target duration of a prompt eval, stop and pause are checked between them
 
 class Config {
 public:
@@ -38,12 +44,23 @@ public:
     std::string user_avatar = DEFAULT_USER_AVATAR;
     std::string model_dir;
     std::string model_file;
+    std::string draft_model; // small model for speculative decoding, empty = disabled
+    int         n_draft = DEFAULT_N_DRAFT;
     std::string avatar_dir;
     std::vector<std::string> prompt_path = {DEFAULT_PROMPT_PATH};
     std::string ui_dir      = DEFAULT_UI_DIR;
     std::string ui_style    = DEFAULT_UI_STYLE;
     std::string userscripts_dir;
+    std::string prompt_cache_dir = DEFAULT_PROMPT_CACHE_DIR; // empty = disabled
+    int         ui_flush_interval = DEFAULT_UI_FLUSH_INTERVAL; // how often output is sent to UI
     bool        auto_n_keep = false;
+    bool        shared_context = false; // all characters use the same context
+    bool        serial_decode = true; // evals of characters are run one at a time
+    int         decode_threads = 0; // threads per eval, 0 = n_threads of the character
+    int         eval_chunk_ms = DEFAULT_EVAL_CHUNK_MS; // 0 = prompts are evaluated in n_batch chunks
+    int         max_threads = 0; // cores shared by all characters, 0 = all cores
+    int         scheduler_workers = 0; // generation jobs running at once, at least one per character
+    int         checkpoint_budget = DEFAULT_CHECKPOINT_BUDGET; // memory for reply branches, MB
     uint32_t    n_chars     = 1;
     json gpt_json; // GPT params as JSON object before parsing
     std::vector<gpt_params> gpt_parameters;
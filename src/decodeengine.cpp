@@ -0,0 +1,66 @@
+#include "decodeengine.h"
+
+
+/**
+ * @param serial run evals one at a time
+ * @param n_threads threads used by every eval, 0 = threads requested by the model
+ */
+void DecodeEngine::Configure(bool serial, int n_threads) {
+    DecodeEngine::serial = serial;
+    DecodeEngine::n_threads = n_threads;
+    LOG_S(INFO) << "Decode engine: " << (serial ? "serial" : "parallel") << ", threads: " << n_threads;
+}
+
+
+// same as llama_eval, returns true on success
+bool DecodeEngine::Eval(llama_context *ctx, const llama_token *tokens, int n_tokens, int n_past, int n_threads,
+                        bool background) {
+    typedef std::chrono::steady_clock Clock;
+    auto t_start = Clock::now();
+    bool serial = DecodeEngine::serial;
+    if (DecodeEngine::n_threads > 0)
+        n_threads = DecodeEngine::n_threads;
+    n_threads = Scheduler::BeginEval(n_threads, serial);
+
+    if (serial) { // wait for our turn, in arrival order within the priority
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t ticket = next_ticket++;
+        auto &queue = waiting[background];
+        queue.push_back(ticket);
+        cv.wait(lock, [&queue, ticket, background] {
+            return !running && queue.front() == ticket && (!background || waiting[0].empty());
+        });
+        queue.pop_front();
+        running = true;
+    }
+
+    auto t_eval = Clock::now();
+    bool ret = llama_eval(ctx, tokens, n_tokens, n_past, n_threads) == 0;
+    auto t_end = Clock::now();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stats.n_evals++;
+        stats.n_tokens += n_tokens;
+        stats.wait_ms += std::chrono::duration<double, std::milli>(t_eval - t_start).count();
+        stats.eval_ms += std::chrono::duration<double, std::milli>(t_end - t_eval).count();
+        if (serial)
+            running = false;
+    }
+    if (serial)
+        cv.notify_all();
+    Scheduler::EndEval(n_threads, serial);
+    return ret;
+}
+
+
+DecodeStats DecodeEngine::GetStats(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    return stats;
+}
+
+
+void DecodeEngine::ResetStats(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    stats = DecodeStats();
+}
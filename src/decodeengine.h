@@ -0,0 +1,53 @@
+#ifndef DECODEENGINE_H
+#define DECODEENGINE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+
+#include "loguru.hpp"
+
+#include "llama.h"
+
+#include "scheduler.h"
+
+struct DecodeStats {
+    uint64_t n_evals = 0;
+    uint64_t n_tokens = 0;
+    double wait_ms = 0; // total time spent waiting for the turn
+    double eval_ms = 0;
+};
+
+
+/**
+ * Runs llama_eval calls of all Models. This llama.cpp has a single sequence per context,
+ * so evals of different characters can't be combined into one forward pass. Instead, in
+ * serial mode evals are run one at a time in arrival order, each with the whole thread
+ * budget, which interleaves the characters token by token without oversubscribing the
+ * CPU. Background evals (e.g. prefilling the next speaker) run only when no foreground
+ * eval is waiting. In parallel mode every eval runs immediately on the calling thread.
+ */
+class DecodeEngine {
+public:
+    static void Configure(bool serial, int n_threads);
+    static bool Eval(llama_context *ctx, const llama_token *tokens, int n_tokens, int n_past, int n_threads,
+                     bool background = false);
+    static DecodeStats GetStats(void);
+    static void ResetStats(void);
+
+private:
+    inline static std::mutex mutex;
+    inline static std::condition_variable cv;
+    inline static uint64_t next_ticket = 0;
+    inline static std::deque<uint64_t> waiting[2]; // tickets of foreground and background evals
+    inline static bool running = false;
+
+    inline static std::atomic<bool> serial = true;
+    inline static std::atomic<int> n_threads = 0; // 0 = use threads of the caller
+    inline static DecodeStats stats;
+};
+
+#endif // DECODEENGINE_H
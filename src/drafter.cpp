@@ -0,0 +1,94 @@
+#include "drafter.h"
+
+
+Drafter::~Drafter() {
+    if (this->ctx)
+        llama_free(this->ctx);
+    if (this->model)
+        ModelRegistry::Release(this->model);
+}
+
+
+/**
+ * Loads the draft model, its context uses the same size and threads as the main one.
+ * @param target context of the main model, the vocabularies must match
+ */
+bool Drafter::Load(const gpt_params &params, const std::string &path, llama_context *target) {
+    this->params = params;
+    this->params.model = path;
+    this->params.lora_adapter.clear(); // adapter belongs to the main model
+    this->params.lora_base.clear();
+
+    auto lparams = llama_context_default_params();
+    lparams.n_ctx = params.n_ctx;
+    lparams.seed = params.seed;
+    lparams.f16_kv = params.memory_f16;
+    lparams.use_mmap = params.use_mmap;
+    lparams.use_mlock = params.use_mlock;
+
+    this->model = ModelRegistry::Acquire(this->params, lparams);
+    if (this->model == nullptr)
+        return false;
+
+    this->ctx = llama_new_context_with_model(this->model, lparams);
+    if (this->ctx == nullptr) {
+        LOG_S(ERROR) << "Failed to create context for the draft model: " << path;
+        return false;
+    }
+    if (llama_n_vocab(this->ctx) != llama_n_vocab(target)) {
+        LOG_S(ERROR) << "Vocabulary of the draft model doesn't match the main model: " << path;
+        return false;
+    }
+    LOG_S(INFO) << "Loaded draft model: " << path;
+    return true;
+}
+
+
+/**
+ * Proposes up to n_draft tokens following tokens, which is the whole conversation in the
+ * context of the main model including the last sampled token. Tokens are picked greedily,
+ * so the RNG of the main model isn't touched.
+ * @return proposed tokens, empty if they don't fit into the context
+ */
+std::vector<llama_token> Drafter::Propose(const std::vector<llama_token> &tokens, int n_draft) {
+    std::vector<llama_token> draft;
+    const int n_ctx = llama_n_ctx(this->ctx);
+    const int n_vocab = llama_n_vocab(this->ctx);
+    if (tokens.empty() || n_draft <= 0 || (int) tokens.size() + n_draft > n_ctx)
+        return draft;
+
+    // catch up with the main model, usually only the last sampled tokens differ
+    int n_past = 0;
+    while (n_past < (int) std::min(this->evaluated.size(), tokens.size()) &&
+           this->evaluated[n_past] == tokens[n_past])
+        n_past++;
+    if (n_past == (int) tokens.size())
+        n_past--; // last token is evaluated again to get the logits
+    this->evaluated.resize(n_past);
+
+    for (int i = n_past; i < (int) tokens.size(); i += this->params.n_batch) {
+        int n_eval = std::min((int) tokens.size() - i, this->params.n_batch);
+        if (!DecodeEngine::Eval(this->ctx, &tokens[i], n_eval, i, this->params.n_threads)) {
+            LOG_S(ERROR) << "Failed to eval the draft model";
+            this->evaluated.clear();
+            return draft;
+        }
+        this->evaluated.insert(this->evaluated.end(), tokens.begin() + i, tokens.begin() + i + n_eval);
+    }
+
+    while (true) {
+        const float *logits = llama_get_logits(this->ctx);
+        llama_token id = (llama_token) (std::max_element(logits, logits + n_vocab) - logits);
+        draft.push_back(id);
+        if ((int) draft.size() >= n_draft || id == llama_token_eos())
+            break;
+
+        if (!DecodeEngine::Eval(this->ctx, &id, 1, (int) this->evaluated.size(), this->params.n_threads)) {
+            LOG_S(ERROR) << "Failed to eval the draft model";
+            this->evaluated.clear();
+            break;
+        }
+        this->evaluated.push_back(id);
+    }
+    return draft;
+}
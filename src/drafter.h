@@ -0,0 +1,36 @@
+#ifndef DRAFTER_H
+#define DRAFTER_H
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "loguru.hpp"
+
+#include "examples/common.h"
+#include "llama.h"
+
+#include "decodeengine.h"
+#include "registry.h"
+
+/**
+ * Small draft model used for speculative decoding. It greedily proposes the next few
+ * tokens of the conversation, which the main model then verifies in a single eval.
+ * The draft context keeps its own copy of the conversation in its KV cache and only
+ * evaluates the tokens which differ from the previous call.
+ */
+class Drafter {
+public:
+    ~Drafter();
+
+    bool Load(const gpt_params &params, const std::string &path, llama_context *target);
+    std::vector<llama_token> Propose(const std::vector<llama_token> &tokens, int n_draft);
+
+private:
+    gpt_params params;
+    llama_model *model = nullptr; // shared weights, owned by ModelRegistry
+    llama_context *ctx = nullptr;
+    std::vector<llama_token> evaluated; // tokens in the KV cache, by position
+};
+
+#endif // DRAFTER_H
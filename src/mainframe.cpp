@@ -88,27 +88,12 @@ MainFrame::MainFrame(const wxString& title, const wxPoint& pos, const wxSize& si
         this->config->gpt_parameters.at(0).prompt = tmp; // FIXME: handle multiple chars here
     }
     
-    while (!this->InitializeModels()) { // show dialog to load model
-        wxFileDialog openFileDialog(this, _("Select model file"), this->config->model_dir, "",
-                       "*", wxFD_OPEN|wxFD_FILE_MUST_EXIST);
-        
-        while (openFileDialog.ShowModal() == wxID_CANCEL); // show dialog until user makes a selection
-        
-        std::string model_path = openFileDialog.GetPath().utf8_string();
-        LOG_S(INFO) << "Selected model: " << model_path;
-        std::size_t found = model_path.find_last_of("/\\");
-        this->config->model_dir = model_path.substr(0, found);
-        this->config->model_file = model_path.substr(found + 1);
-    }
-
     CreateModelList();
 
+    this->transcript = new Transcript(this->config);
     this->webview = new Webview(this, this->config->ui_dir, this->config->ui_style,
-                                this->config->userscripts_dir, this->config->avatar_dir);
-
-    for (uint32_t i = 0; i < this->models.size(); i++) {
-        this->models.at(i)->SetWebview(this->webview);
-    }
+                                this->config->userscripts_dir, this->config->avatar_dir,
+                                this->config->ui_flush_interval);
     
     // build GUI
     wxInitAllImageHandlers();
@@ -164,6 +149,9 @@ MainFrame::MainFrame(const wxString& title, const wxPoint& pos, const wxSize& si
                                       &MainFrame::WebviewCommand, this);
     this->webview->GetBrowser()->Bind(wxEVT_WEBVIEW_LOADED, 
                                       &MainFrame::WebviewOnLoaded, this);
+    
+    // window is shown while the model is loading
+    this->LoadModels(std::bind(&MainFrame::OnStartupLoaded, this, std::placeholders::_1));
 }
 
 
@@ -174,15 +162,17 @@ void MainFrame::OnExit(wxCommandEvent& event) {
 
 void MainFrame::OnClose(wxCloseEvent& event) {
     
-    for (uint32_t i = 0; i < this->models.size(); i++) {
-        if (this->models.at(i)) {
-            this->models.at(i)->StopGeneration();
-            while (this->models.at(i)->GetBusy()) // we need to wait if model is processing prompt/input
-                sleep(0.1);
-            delete this->models.at(i);
-        }
+    // loading can't be interrupted, its result is dropped
+    if (this->loader.joinable())
+        this->loader.join();
+    {
+        std::lock_guard<std::mutex> lock(this->loader_mutex);
+        this->DeleteModels(this->loaded_models);
     }
+    this->DeleteModels(this->models);
+    Scheduler::Stop();
     delete this->webview;
+    delete this->transcript;
     
     // save current configuration
     this->SaveConfig(this->config_file);  
@@ -209,46 +199,162 @@ void MainFrame::OnMouseWheel(wxMouseEvent& event) {
 
 
 
-bool MainFrame::InitializeModels(void) {
+/**
+ * Starts loading models of the current configuration in the background. Old models keep
+ * serving until the new ones are ready, then they are replaced by FinishLoading.
+ * @param on_loaded called on the GUI thread with the result
+ */
+bool MainFrame::LoadModels(std::function<void(bool)> on_loaded) {
+    if (this->loading) {
+        LOG_S(WARNING) << "Models are already being loaded";
+        return false;
+    }
+    if (this->loader.joinable())
+        this->loader.join();
     
-    uint32_t i;
+    this->loading = true;
+    this->on_loaded = on_loaded;
+    this->webview->QueueScript("updateStatusbar('Loading model: " + this->config->model_file + " ...');");
     
-    // delete old models if they exist
-    for (i = 0; i < this->models.size(); i++) {
-        if (this->models.at(i)) {
-            // if generation is running, we must stop it before deleting the model
-            this->models.at(i)->StopGeneration();
-            while (this->models.at(i)->GetBusy()) // we need to wait if model is processing prompt/input
-                sleep(0.1);
-            delete this->models.at(i);
-        }        
-    }
+    // configuration may change while loading, the loader uses a copy of it
+    this->loader = std::thread(&MainFrame::LoadModelsThread, this, *this->config);
+    return true;
+}
+
+
+// progress of the loader, reported to the statusbar in steps of 1%
+struct LoadProgress {
+    Webview *webview;
+    std::string text;
+    int percent = -1;
+};
+
+
+void MainFrame::ReportLoadProgress(float progress, void *data) {
+    LoadProgress *p = (LoadProgress *) data;
+    int percent = (int) (progress*100);
+    if (percent == p->percent)
+        return;
+    p->percent = percent;
+    p->webview->QueueScript("updateStatusbar('" + p->text + std::to_string(percent) + "%');");
+}
+
+
+// runs on the loader thread, models don't have sinks until they replace the old ones
+// only the copy of the config is read here, the GUI thread may change the original meanwhile
+void MainFrame::LoadModelsThread(Config config) {
+    std::vector<Model *> new_models;
+    bool ok = true;
     
-    // create new models
-    for (i = 0; i < this->config->n_chars; i++) {
-        if (this->models.size() <= i) { // create new vector element
-            this->models.push_back(new Model(this->webview, this->config, i));
-        } else { // use existing element
-            this->models.at(i) = new Model(this->webview, this->config, i);
-        }
-        this->models.at(i)->SetGPTParams(this->config->gpt_parameters.at(i));
+    // with shared context the first model generates replies of all chars
+    uint32_t n_models = config.shared_context ? 1 : config.n_chars;
+    std::string model_path = config.model_dir + "/" + config.model_file;
+    std::string draft_path;
+    if (!config.draft_model.empty())
+        draft_path = (fs::path(config.model_dir) / config.draft_model).string();
+    
+    for (uint32_t i = 0; i < n_models && ok; i++) {
+        new_models.push_back(new Model(nullptr, this->config, i));
+        new_models.at(i)->SetGPTParams(config.gpt_parameters.at(i));
         
+        LoadProgress progress{this->webview, "Loading model " + std::to_string(i + 1) + "/" +
+                              std::to_string(n_models) + ": " + config.model_file + " "};
         // check that the model file exists
-        std::ifstream file;
-        std::string model_path = this->config->model_dir + "/" + this->config->model_file;
-        file.open(model_path);
-        if (file.good()) {
-            if (this->models.at(i)->LoadModel(model_path)) {
-                this->config->gpt_parameters.at(i).model = model_path;
-            } else { // invalid model file
-                return false;
+        ok = fs::exists(model_path) &&
+             new_models.at(i)->LoadModel(model_path, draft_path, &MainFrame::ReportLoadProgress, &progress);
+    }
+    
+    {
+        std::lock_guard<std::mutex> lock(this->loader_mutex);
+        this->DeleteModels(this->loaded_models); // just in case
+        this->loaded_models = new_models;
+        this->loaded_ok = ok;
+    }
+    this->CallAfter(&MainFrame::FinishLoading);
+}
+
+
+// replaces the old models with the loaded ones, runs on the GUI thread
+void MainFrame::FinishLoading(void) {
+    std::vector<Model *> new_models;
+    bool ok;
+    {
+        std::lock_guard<std::mutex> lock(this->loader_mutex);
+        new_models.swap(this->loaded_models);
+        ok = this->loaded_ok;
+    }
+    this->loading = false;
+    
+    if (ok) {
+        // if generation is running, it's stopped before the old models are deleted
+        this->DeleteModels(this->models);
+        this->models = new_models;
+        
+        DecodeEngine::Configure(this->config->serial_decode, this->config->decode_threads);
+        // every character needs a worker for its generation session
+        Scheduler::Start(this->config->scheduler_workers, this->models.size(), this->config->max_threads);
+        
+        for (uint32_t i = 0; i < this->models.size(); i++) {
+            // replies must be in the transcript before the UI asks for the next input
+            this->models.at(i)->AddSink(this->transcript);
+            this->models.at(i)->AddSink(this->webview);
+            // params may have been changed while the models were loaded from the old copy
+            if (i < this->config->gpt_parameters.size()) {
+                this->config->gpt_parameters.at(i).model = this->models.at(i)->GetGPTParams().model;
+                this->models.at(i)->SetGPTParams(this->config->gpt_parameters.at(i));
             }
-        } else { // model file not found or not accessible
-            return false;
         }
+        this->webview->QueueScript("updateStatusbar('Loaded model: " + this->config->model_file + "');");
+    } else {
+        this->DeleteModels(new_models);
     }
     
-    return true;
+    std::function<void(bool)> callback;
+    callback.swap(this->on_loaded);
+    if (callback)
+        callback(ok);
+}
+
+
+// asks for another model file until loading succeeds
+void MainFrame::OnStartupLoaded(bool ok) {
+    if (ok)
+        return;
+    
+    wxFileDialog openFileDialog(this, _("Select model file"), this->config->model_dir, "",
+                   "*", wxFD_OPEN|wxFD_FILE_MUST_EXIST);
+    
+    while (openFileDialog.ShowModal() == wxID_CANCEL); // show dialog until user makes a selection
+    
+    std::string model_path = openFileDialog.GetPath().utf8_string();
+    LOG_S(INFO) << "Selected model: " << model_path;
+    std::size_t found = model_path.find_last_of("/\\");
+    this->config->model_dir = model_path.substr(0, found);
+    this->config->model_file = model_path.substr(found + 1);
+    
+    CreateModelList();
+    this->LoadModels(std::bind(&MainFrame::OnStartupLoaded, this, std::placeholders::_1));
+}
+
+
+void MainFrame::DeleteModels(std::vector<Model *> &models) {
+    for (auto model : models) {
+        // if generation is running, we must stop it before deleting the model
+        model->StopGeneration();
+        model->WaitUntilIdle(); // we need to wait if model is processing prompt/input
+        delete model;
+    }
+    models.clear();
+}
+
+
+// returns the model generating replies of the char and makes the char its speaker
+Model *MainFrame::GetModel(int char_index) {
+    if (!this->config->shared_context && (size_t) char_index < this->models.size())
+        return this->models.at(char_index);
+    
+    this->models.at(0)->SetSpeaker(char_index);
+    return this->models.at(0);
 }
 
 
@@ -281,26 +387,16 @@ void MainFrame::OnSaveConversation(wxCommandEvent& event) {
         }
     }
 
-    wxString output;
-    if (this->webview->GetBrowser()->RunScript("retrieveLog();", &output)) {
-        
-        // show save dialog
-        wxFileDialog saveFileDialog(this, _("Save conversation"), "", "", 
-                                    "JSON files (*.json)|*.json", wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
-        
-        if (saveFileDialog.ShowModal() == wxID_CANCEL)
-            return;
-        
-        output = utils::CleanJSString(output.ToStdString());
-        json j = json::parse(output);
-        
-        bool ret = this->SaveJSON(j, saveFileDialog.GetPath().utf8_string());
-        if (!ret)
-            wxLogError("Error saving conversation to: %s", saveFileDialog.GetPath());       
-        
-    } else { // some error happened
-        LOG_S(ERROR) << "Error retrieving conversation log";
-    }
+    // show save dialog
+    wxFileDialog saveFileDialog(this, _("Save conversation"), "", "", 
+                                "JSON files (*.json)|*.json", wxFD_SAVE|wxFD_OVERWRITE_PROMPT);
+    
+    if (saveFileDialog.ShowModal() == wxID_CANCEL)
+        return;
+    
+    bool ret = this->SaveJSON(this->transcript->ToJSON(), saveFileDialog.GetPath().utf8_string());
+    if (!ret)
+        wxLogError("Error saving conversation to: %s", saveFileDialog.GetPath());       
 }
 
 
@@ -318,10 +414,22 @@ void MainFrame::OnLoadConfig(wxCommandEvent& event) {
     if (openFileDialog.ShowModal() == wxID_CANCEL)
         return;
 
+    // the loader would install models of the old config under the new one
+    if (this->loading) {
+        this->webview->QueueScript("updateStatusbar('Model is still loading...');");
+        return;
+    }
+
+    // old conversation can't continue with the new configuration
+    for (auto model : this->models)
+        model->StopGeneration();
+    
     this->config_file = openFileDialog.GetPath().utf8_string();
     this->config->ParseFile(this->config_file);
-    InitializeModels(); // reloads the model
-    SetUIParameters(); // send new config to UI
+    this->webview->GetChannel()->SetInterval(this->config->ui_flush_interval);
+    this->LoadModels([this](bool ok) { // reloads the model
+        SetUIParameters(); // send new config to UI
+    });
 }
 
 
@@ -377,8 +485,8 @@ bool MainFrame::SaveJSON(json j, std::string file_path) {
 
 // for testing
 void MainFrame::OnGenerate(wxCommandEvent& event) {
-    std::thread thread(&Model::GenerateOutput, this->models.at(0), "Hi there");
-    thread.detach();
+    if (!this->models.empty())
+        this->models.at(0)->StartGeneration("Hi there");
 }
 
 void MainFrame::OnPause(wxCommandEvent& event) {
@@ -403,7 +511,8 @@ void MainFrame::OnReloadUI(wxCommandEvent& event) {
 
 // used for debugging
 void MainFrame::OnDebug(wxCommandEvent& event) {
-    this->models.at(0)->RegenerateOutput();
+    if (!this->models.empty())
+        this->models.at(0)->RegenerateOutput();
 
 }
 
@@ -413,20 +522,33 @@ void MainFrame::WebviewCommand(wxWebViewEvent& event) {
 
     uint32_t i;
     json j = json::parse(event.GetString()); // parse incoming message as JSON
+    
+    // there are no models until the first one has been loaded
+    if (this->models.empty() && (j["cmd"] == "start generation" || j["cmd"] == "continue generation" ||
+                                 j["cmd"] == "regenerate" || j["cmd"] == "switch reply")) {
+        std::string script = "generationStopped(); updateStatusbar('Model is still loading...');";
+        if (j["cmd"] == "start generation") // prompt must be sent again
+            script += "first_run[modelIndex(" + std::to_string(j["params"]["char_index"].get<int>()) + ")] = true;";
+        this->webview->QueueScript(script);
+        return;
+    }
 
     // check for commands, unfortunately C++ doesn't support switch statement on strings
-    if (j["cmd"] == "start generation") {
-        std::string prompt = j["params"]["prompt"];
+    if (j["cmd"] == "start generation" || j["cmd"] == "continue generation") {
+        // only the new message of the user is sent, null if the char continues on its own
         int n = j["params"]["char_index"].get<int>();
-        prompt = utils::CleanJSString(prompt);
-        std::thread thread(&Model::GenerateOutput, this->models.at(n), prompt);
-        thread.detach();
+        std::string input, user_line;
+        if (j["params"]["input"].is_string()) {
+            input = utils::CleanJSString(j["params"]["input"].get<std::string>());
+            user_line = this->config->user_name + ":" + input + "\n";
+        }
         
-    } else if (j["cmd"] == "continue generation") {
-        int n = j["params"]["char_index"].get<int>();
-        std::string input = j["params"]["input"];
-        input = utils::CleanJSString(input);
-        this->models.at(n)->AddUserInput(input);
+        if (j["cmd"] == "start generation")
+            this->GetModel(n)->StartGeneration(this->transcript->BuildPrompt(n, user_line));
+        else
+            this->GetModel(n)->AddUserInput(this->transcript->BuildInput(n, user_line));
+        if (user_line.size() > 0)
+            this->transcript->Append(this->config->user_name + ": " + input);
         
     } else if (j["cmd"] == "toggle generation") {
         for (i = 0; i < this->models.size(); i++) {
@@ -451,6 +573,7 @@ void MainFrame::WebviewCommand(wxWebViewEvent& event) {
             //LOG_S(INFO) << "Received new params from UI: " << params_s;
             uint32_t new_seed;
             this->config->ParseJSON(params_s);
+            this->webview->GetChannel()->SetInterval(this->config->ui_flush_interval);
             for (i = 0; i < this->models.size(); i++) {
                 new_seed = this->config->gpt_parameters.at(i).seed;
                 this->models.at(i)->SetGPTParams(this->config->gpt_parameters.at(i), true, &new_seed);
@@ -463,18 +586,42 @@ void MainFrame::WebviewCommand(wxWebViewEvent& event) {
         if (j.contains("model")) {
             std::string old_model = this->config->model_file; // save just in case
             this->config->model_file = j["model"].get<std::string>();
-            if (InitializeModels()) { // model loaded successfully
-                SetUIParameters(); // send new parameters to UI
-            } else { // some error
-                this->webview->GetBrowser()->RunScript("updateStatusbar('Error loading model: " + this->config->model_file + "');");    
-                this->config->model_file = old_model; // revert
-            }
+            // current model keeps generating until the new one has been loaded
+            bool started = this->LoadModels([this, old_model](bool ok) {
+                if (ok) { // model loaded successfully
+                    SetUIParameters(); // send new parameters to UI
+                } else { // some error
+                    this->webview->QueueScript("updateStatusbar('Error loading model: " + this->config->model_file + "');");
+                    this->config->model_file = old_model; // revert
+                }
+            });
+            if (!started)
+                this->config->model_file = old_model;
         }
         
     } else if (j["cmd"] =="regenerate") {
         int n = j["params"]["char_index"].get<int>();
         LOG_S(INFO) << "Calling renegerate on character: " << n;
-        this->models.at(n)->RegenerateOutput();
+        this->GetModel(n)->RegenerateOutput(); // the model removes the old reply from the transcript
+        
+    } else if (j["cmd"] == "prefill") {
+        // messages the char hasn't seen yet are the beginning of its next input
+        int n = j["params"]["char_index"].get<int>();
+        std::string input = this->transcript->GetUnseen(n);
+        if (!this->config->shared_context && (size_t) n < this->models.size() && input.size() > 0)
+            this->models.at(n)->PrefillInput(input);
+        
+    } else if (j["cmd"] == "set base") {
+        int n = j["params"]["char_index"].get<int>();
+        std::vector<std::string> base_log;
+        for (const auto &line : j["params"]["base_log"])
+            base_log.push_back(utils::CleanJSString(line.get<std::string>()));
+        this->transcript->SetBase(n, utils::CleanJSString(j["params"]["base_prompt"].get<std::string>()), base_log);
+        
+    } else if (j["cmd"] =="switch reply") {
+        int n = j["params"]["char_index"].get<int>();
+        int direction = j["params"]["direction"].get<int>();
+        this->GetModel(n)->SwitchBranch(direction);
         
     } else {
         LOG_S(WARNING) << "Unknown command received from UI: " << j["cmd"];
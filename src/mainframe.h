@@ -2,6 +2,8 @@
 #define MAINFRAME_H
 
 #include <filesystem>
+#include <functional>
+#include <mutex>
 #include <set>
 #include <thread>
 
@@ -27,6 +29,7 @@ using json = nlohmann::json;
 
 #include "config.h"
 #include "model.h"
+#include "transcript.h"
 #include "webview.h"
 #include "utils.h"
 
@@ -59,7 +62,13 @@ private:
 
     void WebviewCommand(wxWebViewEvent& event); 
     
-    bool InitializeModels(void);
+    bool LoadModels(std::function<void(bool)> on_loaded);
+    void LoadModelsThread(Config config);
+    static void ReportLoadProgress(float progress, void *data);
+    void FinishLoading(void);
+    void OnStartupLoaded(bool ok);
+    void DeleteModels(std::vector<Model *> &models);
+    Model *GetModel(int char_index);
     void CreateModelList(void);
     bool SaveConfig(std::string file_path);
     bool SaveJSON(json j, std::string file_path);
@@ -71,6 +80,15 @@ private:
     Config *config;
     std::vector<Model *> models;
     Webview *webview;
+    Transcript *transcript; // conversation shown in the UI
+    
+    // models are loaded in the background, the old ones serve until they are replaced
+    std::thread loader;
+    std::mutex loader_mutex; // guards loaded_models and loaded_ok
+    std::vector<Model *> loaded_models;
+    bool loaded_ok = false;
+    bool loading = false;
+    std::function<void(bool)> on_loaded; // called on the GUI thread when loading finishes
     
     std::string config_file; // current configuration file
     std::set<std::string> model_files; // list of available model files
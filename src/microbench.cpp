@@ -0,0 +1,347 @@
+// Microbenchmarks of the code which runs for every token or message. Optimized functions
+// are checked against their old implementations, which are kept here as the reference.
+// Sampling is measured only if a config is given, the others don't need a model.
+// Exits with an error if a check fails.
+#include "microbench.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <regex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+using json = nlohmann::json;
+
+#include "llama.h"
+
+#include "config.h"
+#include "ringbuffer.h"
+#include "sampler.h"
+#include "utils.h"
+
+typedef std::chrono::steady_clock Clock;
+
+static volatile size_t bench_sink; // results of the timed calls are stored here so that they aren't optimized out
+
+
+// regex implementation of utils::CleanStringForJS before it was rewritten
+static std::string CleanStringForJSRegex(std::string input) {
+    std::string output;
+
+    output = std::regex_replace(input, std::regex("\""), "&quot;");
+    output = std::regex_replace(output, std::regex("\'"), "&apos;");
+    output = std::regex_replace(output, std::regex("<"), "&lt;");
+    output = std::regex_replace(output, std::regex(">"), "&gt;");
+    output = std::regex_replace(output, std::regex("\n"), "\\n");
+
+    return output;
+}
+
+
+// regex implementation of utils::CleanJSString before it was rewritten
+static std::string CleanJSStringRegex(std::string input) {
+    std::string output;
+
+    output = std::regex_replace(input, std::regex("&quot;"), "\"");
+    output = std::regex_replace(output, std::regex("&apos;"), "\'");
+    output = std::regex_replace(output, std::regex("&lt;"), "<");
+    output = std::regex_replace(output, std::regex("&gt;"), ">");
+    output = std::regex_replace(output, std::regex("\\n"), "\n");
+
+    return output;
+}
+
+
+// calls fn in growing batches until min_ms has passed, returns ns per call
+// fn returns a value which depends on its work
+template <typename F>
+static double TimeNs(F fn, double min_ms = 200) {
+    size_t n = 0, batch = 1, sum = 0;
+    double elapsed_ms = 0;
+    auto t_start = Clock::now();
+    do {
+        for (size_t i = 0; i < batch; i++)
+            sum += fn();
+        n += batch;
+        batch *= 2;
+        elapsed_ms = std::chrono::duration<double, std::milli>(Clock::now() - t_start).count();
+    } while (elapsed_ms < min_ms);
+    bench_sink = sum;
+    return elapsed_ms*1e6/n;
+}
+
+
+// random text made of the characters and entity fragments which are special for the escaping
+static std::string RandomText(std::mt19937 &rng, size_t n_fragments) {
+    static const char *fragments[] = {
+        "a", "Bob", " ", "\n", "\"", "'", "<", ">", "&", ";", "\\", "\\n", "&quot;", "&apos;",
+        "&lt;", "&gt;", "&amp;", "&q", "uot;", "&l", "t;", "\xC3\xA9", "\xF0\x9F\x98\x80"
+    };
+    std::uniform_int_distribution<size_t> pick(0, sizeof(fragments)/sizeof(fragments[0]) - 1);
+    std::string text;
+    for (size_t i = 0; i < n_fragments; i++)
+        text += fragments[pick(rng)];
+    return text;
+}
+
+
+// compares both directions with the regex versions on random inputs
+static json FuzzCleanString(int n_cases, bool &ok) {
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<size_t> length(0, 64);
+    int n_escape_diff = 0, n_unescape_diff = 0;
+    for (int i = 0; i < n_cases; i++) {
+        std::string text = RandomText(rng, length(rng));
+        if (utils::CleanStringForJS(text) != CleanStringForJSRegex(text)) {
+            if (n_escape_diff++ == 0)
+                std::cerr << "CleanStringForJS differs from the reference for: " << json(text).dump() << "\n";
+        }
+        if (utils::CleanJSString(text) != CleanJSStringRegex(text)) {
+            if (n_unescape_diff++ == 0)
+                std::cerr << "CleanJSString differs from the reference for: " << json(text).dump() << "\n";
+        }
+    }
+    ok = ok && n_escape_diff == 0 && n_unescape_diff == 0;
+    return json{
+        {"cases",              n_cases},
+        {"escape_mismatches",  n_escape_diff},
+        {"unescape_mismatches", n_unescape_diff}
+    };
+}
+
+
+// escaping of single tokens (every flush) and whole prompts (messages from the UI)
+static json BenchCleanString(void) {
+    std::string prompt;
+    const std::string line = "User: Can you write \"<b>bold</b>\" in HTML? It's for my page.\n"
+                             "Bob: Sure, use <b> and </b> around the text: \"<b>text</b>\".\n";
+    std::vector<std::pair<std::string, std::string>> inputs = {
+        {"token_plain",  " the"},
+        {"token_quote",  "\""},
+        {"token_newline", "\n"},
+    };
+    for (size_t size : {4096, 65536}) {
+        while (prompt.size() < size)
+            prompt += line;
+        inputs.push_back({"prompt_" + std::to_string(size/1024) + "kb", prompt});
+    }
+
+    json results = json::object();
+    for (const auto &[name, text] : inputs) {
+        std::string escaped = utils::CleanStringForJS(text);
+        double escape_regex = TimeNs([&text] { return CleanStringForJSRegex(text).size(); });
+        double escape = TimeNs([&text] { return utils::CleanStringForJS(text).size(); });
+        double unescape_regex = TimeNs([&escaped] { return CleanJSStringRegex(escaped).size(); });
+        double unescape = TimeNs([&escaped] { return utils::CleanJSString(escaped).size(); });
+        results[name] = {
+            {"bytes",             text.size()},
+            {"escape_regex_ns",   escape_regex},
+            {"escape_ns",         escape},
+            {"unescape_regex_ns", unescape_regex},
+            {"unescape_ns",       unescape}
+        };
+    }
+    return results;
+}
+
+
+// last_n_tokens for every generated token: push the token and read the penalty window
+// the vector version is the old one, erasing the first element moves the whole window
+static json BenchRingBuffer(void) {
+    const int n_last = 64; // default repeat_last_n
+    json results = json::object();
+    for (int n_ctx : {512, 2048, 8192, 32768}) {
+        std::vector<llama_token> vector(n_ctx, 0);
+        RingBuffer<llama_token> ring(n_ctx, 0);
+        llama_token id = 0;
+        double vector_ns = TimeNs([&vector, &id] {
+            vector.erase(vector.begin());
+            vector.push_back(id++);
+            return (size_t) vector.data()[vector.size() - n_last];
+        });
+        id = 0;
+        double ring_ns = TimeNs([&ring, &id] {
+            ring.PushBack(id++);
+            return (size_t) ring.Data()[ring.Size() - n_last];
+        });
+        results[std::to_string(n_ctx)] = {
+            {"vector_ns", vector_ns},
+            {"ring_ns",   ring_ns}
+        };
+    }
+    return results;
+}
+
+
+// per-token sampling in Model::GenerateOutput before Sampler: the candidates are allocated
+// on every call and the logit_bias map is added to the logits of the context
+// logits are restored afterwards so that every call samples from the same input
+static llama_token SampleReference(llama_context *ctx, const gpt_params &params,
+                                   const llama_token *last_tokens, int n_last_tokens) {
+    const float   temp            = params.temp;
+    const int32_t top_k           = params.top_k <= 0 ? llama_n_vocab(ctx) : params.top_k;
+    const float   top_p           = params.top_p;
+    const float   tfs_z           = params.tfs_z;
+    const float   typical_p       = params.typical_p;
+    const float   repeat_penalty  = params.repeat_penalty;
+    const float   alpha_presence  = params.presence_penalty;
+    const float   alpha_frequency = params.frequency_penalty;
+    const int     mirostat        = params.mirostat;
+    const float   mirostat_tau    = params.mirostat_tau;
+    const float   mirostat_eta    = params.mirostat_eta;
+    const bool    penalize_nl     = params.penalize_nl;
+
+    llama_token id = 0;
+    auto logits = llama_get_logits(ctx);
+    auto n_vocab = llama_n_vocab(ctx);
+
+    for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++)
+        logits[it->first] += it->second;
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < n_vocab; token_id++)
+        candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
+
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+
+    float nl_logit = logits[llama_token_nl()];
+    llama_sample_repetition_penalty(ctx, &candidates_p, last_tokens, n_last_tokens, repeat_penalty);
+    llama_sample_frequency_and_presence_penalties(ctx, &candidates_p, last_tokens, n_last_tokens,
+                                                  alpha_frequency, alpha_presence);
+    if (!penalize_nl)
+        logits[llama_token_nl()] = nl_logit;
+
+    if (temp <= 0) {
+        id = llama_sample_token_greedy(ctx, &candidates_p);
+    } else if (mirostat == 1) {
+        static float mirostat_mu = 2.0f * mirostat_tau;
+        const int mirostat_m = 100;
+        llama_sample_temperature(ctx, &candidates_p, temp);
+        id = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
+    } else if (mirostat == 2) {
+        static float mirostat_mu = 2.0f * mirostat_tau;
+        llama_sample_temperature(ctx, &candidates_p, temp);
+        id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
+    } else {
+        llama_sample_top_k(ctx, &candidates_p, top_k, 1);
+        llama_sample_tail_free(ctx, &candidates_p, tfs_z, 1);
+        llama_sample_typical(ctx, &candidates_p, typical_p, 1);
+        llama_sample_top_p(ctx, &candidates_p, top_p, 1);
+        llama_sample_temperature(ctx, &candidates_p, temp);
+        id = llama_sample_token(ctx, &candidates_p);
+    }
+
+    for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++)
+        logits[it->first] -= it->second;
+    return id;
+}
+
+
+// Sampler::Sample and the old sampling with the parameters of the first character on the
+// logits of its prompt
+static json BenchSampler(const Config &config, const std::string &model_path, int n_threads) {
+    gpt_params params = config.gpt_parameters.at(0);
+    if (n_threads > 0)
+        params.n_threads = n_threads;
+
+    auto lparams = llama_context_default_params();
+    lparams.n_ctx = params.n_ctx;
+    lparams.seed = params.seed;
+    llama_model *model = llama_load_model_from_file(model_path.c_str(), lparams);
+    if (model == nullptr) {
+        std::cerr << "Error loading model: " << model_path << "\n";
+        return json::object();
+    }
+    llama_context *ctx = llama_new_context_with_model(model, lparams);
+
+    // logits of the last token of the prompt, neither version changes them
+    std::vector<llama_token> tokens(params.n_ctx);
+    int n_tokens = llama_tokenize(ctx, params.prompt.c_str(), tokens.data(), (int) tokens.size(), true);
+    n_tokens = std::max(1, std::min(n_tokens, params.n_batch));
+    llama_eval(ctx, tokens.data(), n_tokens, 0, params.n_threads);
+
+    RingBuffer<llama_token> last_n_tokens(params.n_ctx, 0);
+    for (int i = 0; i < n_tokens; i++)
+        last_n_tokens.PushBack(tokens[i]);
+    const int repeat_last_n = params.repeat_last_n < 0 ? params.n_ctx : params.repeat_last_n;
+    const int n_last = std::min((int) last_n_tokens.Size(), repeat_last_n);
+
+    Sampler sampler;
+    sampler.SetContext(ctx);
+    sampler.SetParams(params);
+    const llama_token *last_tokens = last_n_tokens.Data() + last_n_tokens.Size() - n_last;
+    double reference_ns = TimeNs([ctx, &params, last_tokens, n_last] {
+        return (size_t) SampleReference(ctx, params, last_tokens, n_last);
+    });
+    double sample_ns = TimeNs([&sampler, last_tokens, n_last] {
+        return (size_t) sampler.Sample(last_tokens, n_last);
+    });
+
+    json results = {
+        {"model",        model_path},
+        {"n_vocab",      llama_n_vocab(ctx)},
+        {"repeat_last_n", n_last},
+        {"reference_ns", reference_ns},
+        {"sample_ns",    sample_ns}
+    };
+    llama_free(ctx);
+    llama_free_model(model);
+    return results;
+}
+
+
+int RunMicroBenchmarks(int argc, char *argv[]) {
+    std::string config_path, model_path, output_path;
+    int n_threads = -1;
+    bool usage = false;
+    for (int i = 2; i < argc && !usage; i++) {
+        std::string arg = argv[i];
+        if (arg[0] != '-' && config_path.empty())
+            config_path = arg;
+        else if (arg == "-m" && i + 1 < argc)
+            model_path = argv[++i];
+        else if (arg == "-t" && i + 1 < argc)
+            n_threads = std::stoi(argv[++i]);
+        else if (arg == "-o" && i + 1 < argc)
+            output_path = argv[++i];
+        else
+            usage = true;
+    }
+    if (usage) {
+        std::cerr << "usage: " << argv[0] << " --micro [config.json] [-m <path>] [-t <n>] [-o <path>]\n";
+        return 1;
+    }
+
+    bool ok = true;
+    json j = {
+        {"fuzz_clean_string",  FuzzCleanString(100000, ok)},
+        {"clean_string",       BenchCleanString()},
+        {"ring_buffer",        BenchRingBuffer()}
+    };
+
+    if (!config_path.empty()) {
+        Config config;
+        if (!config.ParseFile(config_path)) {
+            std::cerr << "Error reading config: " << config_path << "\n";
+            return 1;
+        }
+        if (model_path.empty())
+            model_path = config.model_dir + "/" + config.model_file;
+        llama_init_backend(false);
+        j["sampler"] = BenchSampler(config, model_path, n_threads);
+        ok = ok && j["sampler"].size() > 0;
+    }
+
+    if (output_path.empty()) {
+        std::cout << j.dump(2) << "\n";
+    } else if (!utils::WriteTextFile(j.dump(2), output_path)) {
+        std::cerr << "Error writing results: " << output_path << "\n";
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
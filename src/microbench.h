@@ -0,0 +1,7 @@
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+// microbenchmarks and fuzz checks of the hot paths, "llm-ui-bench --micro"
+int RunMicroBenchmarks(int argc, char *argv[]);
+
+#endif // MICROBENCH_H
@@ -1,29 +1,51 @@
-#include "llama.cpp" // this contains struct definitions for some reason??
-#define LLAMA_VOCAB
 #include "model.h"
 
 
-Model::Model(Webview *webview, Config *config, int char_index) {
+Model::Model(TokenSink *sink, Config *config, int char_index) {
     
-    this->webview = webview;
-    this->config = config;
+    this->AddSink(sink);
+    if (this->config != config) // shared by all models, don't write it while others read it
+        this->config = config;
     this->char_index = char_index;
+    this->speaker = char_index;
+    
+    // checkpoints which don't fit into memory are stored to the temp directory
+    // several models may have the same char_index, e.g. in bench sessions or while reloading
+    std::string spill_prefix = "llm-ui-" + std::to_string(getpid()) + "-" + std::to_string(n_created++) + "-" +
+        std::to_string(char_index) + "-";
+    this->branches = new BranchTree((std::filesystem::temp_directory_path() / spill_prefix).string());
     
     // just in case
     this->stop.clear();
     this->pause.clear();
     
     llama_init_backend(false);
+    
+    std::lock_guard<std::mutex> lock(peers_mutex);
+    peers.push_back(this);
 }
 
 
 Model::~Model() {
+    this->StopGeneration();
+    Scheduler::Cancel(this);
+    {
+        std::lock_guard<std::mutex> lock(peers_mutex);
+        peers.erase(std::remove(peers.begin(), peers.end(), this), peers.end());
+    }
+    delete this->branches;
+    delete this->drafter;
     if (this->ctx)
         llama_free(this->ctx);
+    if (this->model)
+        ModelRegistry::Release(this->model);
 }
 
-// loads LLM model
-bool Model::LoadModel(std::string model_path) {
+// loads LLM model, weights are shared with other characters using the same model
+// draft_path enables speculative decoding, it's passed in since loading doesn't read the config
+// progress is called by llama.cpp while the weights are loaded, not if they are shared
+bool Model::LoadModel(std::string model_path, std::string draft_path, llama_progress_callback progress,
+                      void *progress_data) {
     
     LOG_S(INFO) << "Loading model: " << this->char_index << "\n";
     this->params.model = model_path;
@@ -35,31 +57,53 @@ bool Model::LoadModel(std::string model_path) {
     lparams.f16_kv = this->params.memory_f16;
     lparams.use_mmap = this->params.use_mmap;
     lparams.use_mlock = this->params.use_mlock;
+    lparams.progress_callback = progress;
+    lparams.progress_callback_user_data = progress_data;
+    // draft tokens are verified with the logits of every token in the batch
+    lparams.logits_all = !draft_path.empty();
 
-    if (this->ctx) // free old context if it exists
-        llama_free(this->ctx);
+    delete this->drafter;
+    this->drafter = nullptr;
+    
+    { // free old context if it exists, other models may be copying KV rows from it
+        std::lock_guard<std::mutex> lock(this->kv_mutex);
+        this->evaluated_tokens.clear();
+        if (this->ctx) {
+            llama_free(this->ctx);
+            this->ctx = nullptr;
+        }
+        if (this->model) {
+            ModelRegistry::Release(this->model);
+            this->model = nullptr;
+        }
+    }
 
-    try {
-        this->ctx = llama_init_from_file(this->params.model.c_str(), lparams);
-    } catch (...) {
-        LOG_S(ERROR) << "Error loading model: " << model_path;
+    // lora is applied by the registry since it modifies the shared weights
+    this->model = ModelRegistry::Acquire(this->params, lparams);
+    if (this->model == nullptr) {
+        fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, this->params.model.c_str());
         return false;
     }
-    
+
+    this->ctx = llama_new_context_with_model(this->model, lparams);
     if (this->ctx == NULL) {
-        fprintf(stderr, "%s: error: failed to load model '%s'\n", __func__, this->params.model.c_str());
+        fprintf(stderr, "%s: error: failed to create context for '%s'\n", __func__, this->params.model.c_str());
+        ModelRegistry::Release(this->model);
+        this->model = nullptr;
         return false;
     }
+    this->sampler.SetContext(this->ctx);
+    this->sampler.SetParams(this->params);
+    this->vocab.Build(this->ctx);
+    this->token_cache.clear();
+    this->split_lines = this->CheckLineSplit();
     
-    // check if lora is used
-    if (!this->params.lora_adapter.empty()) {
-    int err = llama_apply_lora_from_file(this->ctx,
-                                         this->params.lora_adapter.c_str(),
-                                         this->params.lora_base.empty() ? NULL : this->params.lora_base.c_str(),
-                                         this->params.n_threads);
-        if (err != 0) {
-            fprintf(stderr, "%s: error: failed to apply lora adapter\n", __func__);
-            return false;
+    if (lparams.logits_all) { // generation works without the draft model, only slower
+        this->drafter = new Drafter();
+        if (!this->drafter->Load(this->params, draft_path, this->ctx)) {
+            LOG_S(WARNING) << "Speculative decoding disabled, failed to load draft model: " << draft_path;
+            delete this->drafter;
+            this->drafter = nullptr;
         }
     }
 
@@ -79,7 +123,7 @@ gpt_params Model::GetGPTParams(void) {
 // if update_seed is true and random seed is generated, store it to new_seed
 bool Model::SetGPTParams(gpt_params new_params, bool update_seed, uint32_t *new_seed) {
     
-    // check if seed has been updated, if yes update ctx->rng
+    // check if seed has been updated, if yes update rng of the context
     if (update_seed) {
         int tmp_seed;
         if (new_params.seed != params.seed) {
@@ -92,57 +136,67 @@ bool Model::SetGPTParams(gpt_params new_params, bool update_seed, uint32_t *new_
             } else {
                 tmp_seed = new_params.seed;
             }
-            //this->ctx->rng = std::mt19937(tmp_seed);
-            this->ctx->rng.seed(tmp_seed);
+            llama_set_rng_seed(this->ctx, tmp_seed);
         }
     }
     this->params = new_params;
+    if (this->ctx)
+        this->sampler.SetParams(new_params);
+    return true;
+}
+
+
+// queues GenerateOutput to the scheduler, returns immediately
+bool Model::StartGeneration(std::string prompt) {
+    Scheduler::Submit(this, [this, prompt] { this->GenerateOutput(prompt); });
     return true;
 }
 
 
 // generates output based on the prompt
 bool Model::GenerateOutput(std::string prompt) {
-    if (this->busy) {
-        LOG_S(WARNING) << "LLM is already generating, returning";
-        return false;
-    }
+    {
+        std::lock_guard<std::mutex> lock(this->state_mutex);
+        if (this->busy) {
+            LOG_S(WARNING) << "LLM is already generating, returning";
+            return false;
+        }
     
-    // just in case these were set before
-    this->stop.clear();
-    this->pause.clear();
+        // just in case these were set before
+        this->stop.clear();
+        this->pause.clear();
+        this->regen_request = false;
+        this->cancel_ms = -1;
         
-    this->busy = true;
-    
-    this->n_outputs = 0;
+        this->busy = true;
+        this->n_outputs = 0;
+    }
   
-    //std::string path_session = this->params.path_session;
-    std::string path_session = this->params.path_prompt_cache;
-    std::vector<llama_token> session_tokens;
-    
     // tokenize the prompt
     this->params.prompt = prompt;
     // Add a space in front of the first character to match OG llama tokenizer behavior
     this->params.prompt.insert(0, 1, ' ');
-    this->webview->GetBrowser()->RunScript("tokenizing();");
-    auto embd_inp = ::llama_tokenize(ctx, params.prompt, true);
+    this->SendState(GenerationState::Tokenizing);
+    auto embd_inp = this->Tokenize(params.prompt, true);
     
-    const auto inp_pfx = ::llama_tokenize(ctx, "\n\n### Instruction:\n\n", true);
-    const auto inp_sfx = ::llama_tokenize(ctx, "\n\n### Response:\n\n", false);
-    auto llama_token_newline = ::llama_tokenize(ctx, "\n", false);
-    auto user_tokens = ::llama_tokenize(ctx, this->config->user_name + ":", false);
+    const auto inp_pfx = this->Tokenize("\n\n### Instruction:\n\n", true);
+    const auto inp_sfx = this->Tokenize("\n\n### Response:\n\n", false);
+    auto llama_token_newline = this->Tokenize("\n", false);
+    auto user_tokens = this->Tokenize(this->config->user_name + ":", false);
     
     const int n_ctx = llama_n_ctx(ctx);
 
     if ((int) embd_inp.size() > n_ctx - 4) {
         fprintf(stderr, "%s: error: prompt is too long (%d tokens, max %d)\n", __func__, (int) embd_inp.size(), n_ctx - 4);
+        this->SetIdle();
+        this->SendState(GenerationState::Stopped);
         return false;
     }
     
     // if n_keep == true and auto_n_keep == true, set n_keep to base prompt 
     // (before user/char lines) TODO: take into account all chars!
     if ((this->params.n_keep == 0) && (this->config->auto_n_keep)) {
-        auto char_tokens = ::llama_tokenize(ctx, this->config->char_names.at(this->char_index) + ":", false);
+        auto char_tokens = this->Tokenize(this->config->char_names.at(this->char_index) + ":", false);
 
         auto user_iter = std::search(embd_inp.begin(), embd_inp.end(), 
                                      user_tokens.begin(), user_tokens.end());
@@ -180,12 +234,14 @@ bool Model::GenerateOutput(std::string prompt) {
     fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
     int i;
     for (i = 0; i < (int) embd_inp.size(); i++) {
-        fprintf(stderr, "%6d -> '%s'\n", embd_inp[i], llama_token_to_str(this->ctx, embd_inp[i]));
+        std::string_view token = this->vocab.Get(embd_inp[i]);
+        fprintf(stderr, "%6d -> '%.*s'\n", embd_inp[i], (int) token.size(), token.data());
     }
     if (this->params.n_keep > 0) {
         fprintf(stderr, "%s: static prompt based on n_keep: '", __func__);
         for (int i = 0; i < this->params.n_keep; i++) {
-            fprintf(stderr, "%s", llama_token_to_str(this->ctx, embd_inp[i]));
+            std::string_view token = this->vocab.Get(embd_inp[i]);
+            fwrite(token.data(), 1, token.size(), stderr);
         }
         fprintf(stderr, "'\n");
     }
@@ -194,18 +250,61 @@ bool Model::GenerateOutput(std::string prompt) {
     
     PrintGPTParams();
     
-    // TODO: replace with ring-buffer
-    this->last_n_tokens.clear();
-    this->last_n_tokens.resize(n_ctx);
-    std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
+    // reuse the part of the prompt which is already in the KV cache, e.g. after a restart
+    int n_reuse = 0;
+    while (n_reuse < (int) std::min(this->evaluated_tokens.size(), embd_inp.size()) &&
+           this->evaluated_tokens[n_reuse] == embd_inp[n_reuse])
+        n_reuse++;
+    if (n_reuse == (int) embd_inp.size())
+        n_reuse--; // last token is evaluated again to get the logits
+    
+    // other characters using the same model may have evaluated a longer prefix
+    n_reuse = this->CopyPrefixFromPeers(embd_inp, n_reuse);
+    
+    // static part of the prompt may be cached on disk
+    this->prompt_cache.SetDir(this->config->prompt_cache_dir);
+    bool store_prompt = false;
+    if (n_reuse < this->params.n_keep) {
+        if (this->prompt_cache.Contains(this->params, embd_inp, this->params.n_keep)) {
+            this->TruncateEvaluated(0); // rows are overwritten by the cache
+            n_reuse = 0;
+            if (this->prompt_cache.Load(this->ctx, this->params, embd_inp, this->params.n_keep)) {
+                n_reuse = this->params.n_keep;
+                std::lock_guard<std::mutex> lock(this->kv_mutex);
+                this->evaluated_tokens.assign(embd_inp.begin(), embd_inp.begin() + n_reuse);
+            }
+        } else {
+            store_prompt = this->prompt_cache.Enabled();
+        }
+    }
+    LOG_S(INFO) << "Reusing " << n_reuse << " of " << embd_inp.size() << " prompt tokens";
+    
+    // matching tokens are skipped when evaluating
+    std::vector<llama_token> session_tokens(embd_inp.begin(), embd_inp.begin() + n_reuse);
+    
+    this->last_n_tokens.Reset(n_ctx, 0);
+    
+    // with shared context any character may speak next, their names end the reply
+    std::vector<std::string> antiprompts = this->params.antiprompt;
+    if (this->config->shared_context) {
+        for (const auto &name : this->config->char_names)
+            antiprompts.push_back(name + ":");
+    }
+    this->antiprompt_matcher.Build(antiprompts);
+    this->prefilled.clear();
+    this->sampler.SetParams(this->params);
+    this->sampler.Reset();
+    this->held_output.clear();
+    this->utf8.Reset();
     
     // store initial state
     n_past = 0;
-    this->old_state.resize(llama_get_state_size(ctx));
-    llama_copy_state_data(this->ctx, this->old_state.data());
-    this->old_n_past = n_past;
+    this->old_snapshot.Save(this->ctx, n_past);
     this->old_last_n_tokens = last_n_tokens;
     this->old_input = prompt;
+    
+    this->branches->Clear();
+    this->branches->SetBudget((size_t) this->config->checkpoint_budget*1024*1024);
 
     bool is_antiprompt = false;
     bool input_noecho  = false;
@@ -218,11 +317,28 @@ bool Model::GenerateOutput(std::string prompt) {
     //console_set_color(this->con_st, CONSOLE_COLOR_PROMPT);
 
     std::vector<llama_token> embd;
+    std::vector<llama_token> draft; // proposed by the draft model, evaluated after embd
+    std::vector<llama_token> accepted; // draft tokens which the main model sampled too
+    std::vector<llama_token> draft_dropped; // oldest last_n_tokens, pushes of rejected tokens are undone with them
+    bool sampled = false; // embd contains a sampled token
+    bool regen = false; // regen was requested during the reply, the input wait handles it
+    
+    // drops the rest of the input and the reply, the input wait restores the old state
+    auto start_regen = [&]() {
+        regen = true;
+        embd.clear();
+        draft.clear();
+        accepted.clear();
+        n_consumed = embd_inp.size();
+        is_interacting = true;
+        this->held_output.clear();
+        this->utf8.Reset();
+    };
 
     while ((n_remain != 0 || params.interactive) && (!this->stop.test())) {
         
-        while (pause.test()) // sleep for a while if paused
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (!this->WaitWhilePaused())
+            break;
 
         // predict
         if (embd.size() > 0) {
@@ -237,12 +353,15 @@ bool Model::GenerateOutput(std::string prompt) {
                 // always keep the first token - BOS
                 n_past = std::max(1, params.n_keep);
                 
+                // rows after n_keep will be overwritten, save the ones needed for regeneration
+                this->old_snapshot.SaveKV(this->ctx, n_past);
+                this->branches->Clear(n_past); // positions of the branches aren't valid anymore
+                
                 // insert n_left/2 tokens at the start of embd from last_n_tokens
                 embd.insert(embd.begin(), last_n_tokens.begin() + n_ctx - n_left/2 - embd.size(), last_n_tokens.end() - embd.size());
             }
             
-            // try to reuse a matching prefix from the loaded session instead of re-eval (via n_past)
-            // REVIEW
+            // reuse a matching prefix of the tokens already in the KV cache instead of re-eval (via n_past)
             if (n_session_consumed < (int) session_tokens.size()) {
                 size_t i = 0;
                 for ( ; i < embd.size(); i++) {
@@ -253,8 +372,10 @@ bool Model::GenerateOutput(std::string prompt) {
 
                     n_past++;
                     n_session_consumed++;
+                    this->branches->AddTokens(&embd[i], 1);
 
                     if (n_session_consumed >= (int) session_tokens.size()) {
+                        i++;
                         break;
                     }
                 }
@@ -263,23 +384,66 @@ bool Model::GenerateOutput(std::string prompt) {
                 }
             }
             
-            // evaluate tokens in batches
+            // a sampled token is evaluated together with the tokens the draft model expects to
+            // follow it, the logits of each of them are checked when sampling
+            if (this->drafter && sampled && embd.size() == 1 && (int) embd_inp.size() <= n_consumed) {
+                int n_draft = std::min({this->config->n_draft, params.n_batch - 1, n_ctx - n_past - 1});
+                if (params.n_predict >= 0)
+                    n_draft = std::min(n_draft, n_remain - 1);
+                
+                std::unique_lock<std::mutex> lock(this->kv_mutex);
+                if ((int) this->evaluated_tokens.size() >= n_past && n_draft > 0) {
+                    std::vector<llama_token> tokens(this->evaluated_tokens.begin(), this->evaluated_tokens.begin() + n_past);
+                    lock.unlock();
+                    tokens.push_back(embd.front());
+                    draft = this->drafter->Propose(tokens, n_draft);
+                }
+            }
+            
+            if (draft.size() > 0) {
+                std::vector<llama_token> batch = embd;
+                batch.insert(batch.end(), draft.begin(), draft.end());
+                if (!this->Evaluate(batch.data(), (int) batch.size(), n_past)) {
+                    fprintf(stderr, "%s : failed to eval\n", __func__);
+                    this->SetIdle();
+                    this->SendState(GenerationState::Stopped);
+                    return false;
+                }
+                // draft tokens are counted when they are accepted
+                n_past += 1;
+                this->n_evaluated += 1;
+                this->branches->AddTokens(&embd[0], 1);
+                embd.clear();
+            }
+            
+            // evaluate tokens in chunks which take about eval_chunk_ms each, so that stop and
+            // pause are handled quickly while a long prompt is processed
             // embd is typically prepared beforehand to fit within a batch, but not always
-            for (int i = 0; i < (int) embd.size(); i += params.n_batch) {
-                int n_eval = (int) embd.size() - i;
-                if (n_eval > params.n_batch) {
-                    n_eval = params.n_batch;
+            for (int i = 0; i < (int) embd.size(); ) {
+                if (!this->WaitWhilePaused())
+                    break; // rows evaluated so far are reused by the next generation
+                if (this->GetRegenRequest()) {
+                    start_regen();
+                    break;
                 }
-                if (llama_eval(ctx, &embd[i], n_eval, n_past, params.n_threads)) {
+                int n_eval = std::min((int) embd.size() - i, this->GetChunkSize());
+                if (!this->Evaluate(&embd[i], n_eval, n_past)) {
                     fprintf(stderr, "%s : failed to eval\n", __func__);
-                    return 1;
+                    this->SetIdle();
+                    this->SendState(GenerationState::Stopped);
+                    return false;
                 }
                 n_past += n_eval;
+                this->n_evaluated += n_eval;
+                this->branches->AddTokens(&embd[i], n_eval);
+                i += n_eval;
             }
+            if (this->stop.test())
+                break;
             
-            if (embd.size() > 0 && !path_session.empty()) {
-                session_tokens.insert(session_tokens.end(), embd.begin(), embd.end());
-                n_session_consumed = session_tokens.size();
+            if (store_prompt && !regen && n_past >= params.n_keep) {
+                this->prompt_cache.Store(this->ctx, this->params, embd_inp, params.n_keep);
+                store_prompt = false;
             }
         }
 
@@ -289,79 +453,32 @@ bool Model::GenerateOutput(std::string prompt) {
             //this->webview->getBrowser()->RunScript("updateStatusbar('Generating reply');");
 
             // out of user input, sample next token
-            const float   temp            = params.temp;
-            const int32_t top_k           = params.top_k <= 0 ? llama_n_vocab(ctx) : params.top_k;
-            const float   top_p           = params.top_p;
-            const float   tfs_z           = params.tfs_z;
-            const float   typical_p       = params.typical_p;
-            const int32_t repeat_last_n   = params.repeat_last_n < 0 ? n_ctx : params.repeat_last_n;
-            const float   repeat_penalty  = params.repeat_penalty;
-            const float   alpha_presence  = params.presence_penalty;
-            const float   alpha_frequency = params.frequency_penalty;
-            const int     mirostat        = params.mirostat;
-            const float   mirostat_tau    = params.mirostat_tau;
-            const float   mirostat_eta    = params.mirostat_eta;
-            const bool    penalize_nl     = params.penalize_nl;
-
-            llama_token id = 0;
-
-            {
-                auto logits = llama_get_logits(ctx);
-                auto n_vocab = llama_n_vocab(ctx);
-
-                // Apply params.logit_bias map
-                for (auto it = params.logit_bias.begin(); it != params.logit_bias.end(); it++) {
-                    logits[it->first] += it->second;
-                }
-
-                std::vector<llama_token_data> candidates;
-                candidates.reserve(n_vocab);
-                for (llama_token token_id = 0; token_id < n_vocab; token_id++) {
-                    candidates.emplace_back(llama_token_data{token_id, logits[token_id], 0.0f});
-                }
-
-                llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
-
-                // Apply penalties
-                float nl_logit = logits[llama_token_nl()];
-                auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), n_ctx);
-                llama_sample_repetition_penalty(ctx, &candidates_p,
-                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                    last_n_repeat, repeat_penalty);
-                llama_sample_frequency_and_presence_penalties(ctx, &candidates_p,
-                    last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
-                    last_n_repeat, alpha_frequency, alpha_presence);
-                if (!penalize_nl) {
-                    logits[llama_token_nl()] = nl_logit;
-                }
-
-                if (temp <= 0) {
-                    // Greedy sampling
-                    id = llama_sample_token_greedy(ctx, &candidates_p);
-                } else {
-                    if (mirostat == 1) {
-                        static float mirostat_mu = 2.0f * mirostat_tau;
-                        const int mirostat_m = 100;
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
-                    } else if (mirostat == 2) {
-                        static float mirostat_mu = 2.0f * mirostat_tau;
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
-                    } else {
-                        // Temperature sampling
-                        llama_sample_top_k(ctx, &candidates_p, top_k, 1);
-                        llama_sample_tail_free(ctx, &candidates_p, tfs_z, 1);
-                        llama_sample_typical(ctx, &candidates_p, typical_p, 1);
-                        llama_sample_top_p(ctx, &candidates_p, top_p, 1);
-                        llama_sample_temperature(ctx, &candidates_p, temp);
-                        id = llama_sample_token(ctx, &candidates_p);
-                    }
+            const int32_t repeat_last_n = params.repeat_last_n < 0 ? n_ctx : params.repeat_last_n;
+            const int n_last = std::min(std::min((int)last_n_tokens.Size(), repeat_last_n), n_ctx);
+            
+            // with a draft the logits of the sampled token are the first row of the batch
+            llama_token id = this->sampler.Sample(last_n_tokens.Data() + last_n_tokens.Size() - n_last, n_last,
+                                                  draft.size() > 0 ? 0 : -1);
+            if (draft.size() > 0) // pushed tokens are taken back if the reply ends within the draft
+                draft_dropped.assign(last_n_tokens.begin(),
+                                     last_n_tokens.begin() + std::min(draft.size() + 1, last_n_tokens.Size()));
+            last_n_tokens.PushBack(id);
+            this->n_sampled++;
+            sampled = true;
+            
+            // draft tokens are accepted as long as the main model samples the same ones with its
+            // own RNG, so the output is the same as without the draft model
+            if (draft.size() > 0) {
+                for (size_t k = 0; k < draft.size() && id == draft[k] && id != llama_token_eos(); k++) {
+                    accepted.push_back(id);
+                    --n_remain;
+                    id = this->sampler.Sample(last_n_tokens.Data() + last_n_tokens.Size() - n_last, n_last, k + 1);
+                    last_n_tokens.PushBack(id);
+                    this->n_sampled++;
                 }
-                // printf("`%d`", candidates_p.size);
-
-                last_n_tokens.erase(last_n_tokens.begin());
-                last_n_tokens.push_back(id);
+                this->n_drafted += draft.size();
+                this->n_accepted += accepted.size();
+                draft.clear();
             }
 
             // replace end of text token with newline token when in interactive mode
@@ -369,8 +486,10 @@ bool Model::GenerateOutput(std::string prompt) {
                 id = llama_token_newline.front();
                 if (params.antiprompt.size() != 0) {
                     // tokenize and inject first reverse prompt
-                    const auto first_antiprompt = ::llama_tokenize(ctx, params.antiprompt.front(), false);
+                    const auto first_antiprompt = this->Tokenize(params.antiprompt.front(), false);
                     embd_inp.insert(embd_inp.end(), first_antiprompt.begin(), first_antiprompt.end());
+                    // injected tokens are input, the matcher doesn't see them
+                    is_antiprompt = true;
                 }
             }
 
@@ -384,10 +503,10 @@ bool Model::GenerateOutput(std::string prompt) {
             --n_remain;
         } else {
             // some user input remains from prompt or interaction, forward it to processing
+            sampled = false;
             while ((int)embd_inp.size() > n_consumed) {
                 embd.push_back(embd_inp[n_consumed]);
-                last_n_tokens.erase(last_n_tokens.begin());
-                last_n_tokens.push_back(embd_inp[n_consumed]);
+                last_n_tokens.PushBack(embd_inp[n_consumed]);
                 ++n_consumed;
                 if ((int) embd.size() >= params.n_batch) {
                     break;
@@ -397,36 +516,54 @@ bool Model::GenerateOutput(std::string prompt) {
 
         // display text, don't display initial prompt (embd is equal to embd_inp)
         if (!input_noecho && (embd != embd_inp)) {
-            for (auto id : embd) {
-                printf("%s", llama_token_to_str(ctx, id));
-                std::string output = std::string(llama_token_to_str(ctx, id));
-                this->webview->AddTokenToUI(output);
+            bool draft_cut = false;
+            for (size_t k = 0; k < accepted.size(); k++) {
+                std::string_view token = this->vocab.Get(accepted[k]);
+                fwrite(token.data(), 1, token.size(), stdout);
+                if (this->OutputText(token)) {
+                    // reply ended within the draft, continue as if accepted[k] was sampled last
+                    this->n_sampled -= accepted.size() - k;
+                    n_remain += accepted.size() - k;
+                    embd.assign(1, accepted[k]);
+                    // accepted and the final token were pushed, keep accepted[0..k]
+                    for (size_t n_pushed = accepted.size() + 1; n_pushed > k + 1; n_pushed--)
+                        last_n_tokens.PopBack(n_pushed <= draft_dropped.size() ? draft_dropped[n_pushed - 1] : 0);
+                    accepted.resize(k);
+                    is_antiprompt = true;
+                    draft_cut = true;
+                    break;
+                }
+            }
+            // prompt chunks longer than n_batch are echoed too, they only go to the console
+            // since the prompt contains the antiprompts and isn't a part of the reply
+            for (size_t k = 0; k < embd.size() && !draft_cut; k++) {
+                std::string_view token = this->vocab.Get(embd[k]);
+                fwrite(token.data(), 1, token.size(), stdout);
+                if (sampled && this->OutputText(token))
+                    is_antiprompt = true;
             }
             fflush(stdout);
         }
+        
+        // accepted draft tokens are already in the KV cache, only the last sampled token isn't
+        if (accepted.size() > 0) {
+            this->branches->AddTokens(accepted.data(), accepted.size());
+            n_past += accepted.size();
+            this->n_evaluated += accepted.size();
+            accepted.clear();
+        }
+        
+        if (sampled && !regen && this->GetRegenRequest())
+            start_regen();
+        
         // in interactive mode, and not currently processing queued inputs;
         // check if we should prompt the user for more
         if (params.interactive && (int) embd_inp.size() <= n_consumed) {
 
-            // check for reverse prompt
-            if (params.antiprompt.size()) {
-                std::string last_output;
-                for (auto id : last_n_tokens) {
-                    last_output += llama_token_to_str(ctx, id);
-                }
-
-                is_antiprompt = false;
-                // Check if each of the reverse prompts appears at the end of the output.
-                for (std::string & antiprompt : params.antiprompt) {
-                    if (last_output.find(antiprompt.c_str(), last_output.length() - antiprompt.length(), antiprompt.length()) != std::string::npos) {
-
-                        is_interacting = true;
-                        is_antiprompt = true;
-                        //set_console_color(this->con_st, CONSOLE_COLOR_USER_INPUT);
-                        fflush(stdout);
-                        break;
-                    }
-                }
+            // reverse prompt is detected by OutputText() while streaming the output
+            if (is_antiprompt) {
+                is_interacting = true;
+                //set_console_color(this->con_st, CONSOLE_COLOR_USER_INPUT);
             }
 
             if (n_past > 0 && is_interacting) {
@@ -478,28 +615,87 @@ bool Model::GenerateOutput(std::string prompt) {
                 // wait for additional input from the user
                 
                 // instead of reading from stdin we are waiting for new input from UI
-                this->pause.test_and_set();
-                this->n_outputs++;
+                {
+                    std::lock_guard<std::mutex> lock(this->state_mutex);
+                    this->pause.test_and_set();
+                    if (!regen) // an interrupted reply isn't finished, it's replaced right away
+                        this->n_outputs++;
+                }
+                if (!regen) {
+                    this->FlushOutput(); // reply ended without antiprompt
+                    this->branches->FinishNode(last_n_tokens, embd);
+                    this->SendState(GenerationState::WaitingForInput);
+                }
+                regen = false;
+                std::string input;
+                while (true) { // wait until we get new input or we are stopped
+                    std::unique_lock<std::mutex> lock(this->state_mutex);
+                    this->waiting_input = true;
+                    this->state_cv.wait(lock, [this] {
+                        return !this->pause.test() || this->new_input.size() > 0 || this->regen_request ||
+                            this->branch_request != 0 || this->prefill_request.size() > 0;
+                    });
+                    
+                    if (this->regen_request) { // last input is evaluated again from the old state
+                        uint32_t seed = this->regen_seed;
+                        this->regen_request = false;
+                        lock.unlock();
+                        this->DropPrefill(embd);
+                        this->RestoreOldState(seed);
+                        lock.lock();
+                        this->new_input = this->old_input;
+                    }
+                    
+                    if (this->branch_request != 0) { // switch to another branch, keep waiting
+                        int direction = this->branch_request;
+                        this->branch_request = 0;
+                        lock.unlock();
+                        // the tree is only accessed by this thread
+                        int id = this->branches->GetSibling(this->branches->GetCurrent(), direction);
+                        if (id >= 0) {
+                            this->DropPrefill(embd);
+                            this->SelectBranch(id, embd);
+                        }
+                        continue;
+                    }
+                    
+                    if (this->prefill_request.size() > 0 && this->new_input.empty()) {
+                        std::string text;
+                        text.swap(this->prefill_request);
+                        lock.unlock();
+                        this->Prefill(text, embd);
+                        continue;
+                    }
+                    this->prefill_request.clear(); // input is here already, it's evaluated normally
+                    
+                    input.swap(this->new_input);
+                    this->pause.clear(); // continue
+                    this->waiting_input = false;
+                    break;
+                }
                 
-                this->webview->GetBrowser()->RunScript("waitingForInput()");
-                while (this->pause.test()) { // sleep for a while if paused
-                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
-                    if (this->new_input.size() > 0)  { // new input received
-                        this->new_input_mutex.lock();
-                        buffer += this->new_input;
-                                                
+                if (input.size() > 0)  { // new input received
+                    if (this->prefilled.size() > 0 && input.compare(0, this->prefilled.size(), this->prefilled) == 0) {
+                        // beginning of the input has been evaluated by Prefill, state was stored there
+                        buffer = input.substr(this->prefilled.size());
+                        this->old_snapshot = this->prefill_snapshot;
+                        this->old_last_n_tokens = this->prefill_last_n_tokens;
+                        this->branches->GetNode(this->branches->GetCurrent()).input = input;
+                        this->prefilled.clear();
+                    } else {
+                        this->DropPrefill(embd);
+                        buffer += input;
+                                            
                         // store current state
-                        this->old_state.resize(llama_get_state_size(ctx));
-                        llama_copy_state_data(this->ctx, this->old_state.data());
-                        this->old_n_past = n_past;
+                        this->old_snapshot.Save(this->ctx, n_past);
                         this->old_last_n_tokens = last_n_tokens;
-                        this->old_input = this->new_input;
-                        
-                        this->new_input.clear();
-                        this->new_input_mutex.unlock();
-                        this->pause.clear(); // continue
-                        this->webview->GetBrowser()->RunScript("generating();");
+                        this->branches->AddNode(input);
                     }
+                    this->old_input = input;
+                    
+                    this->antiprompt_matcher.Reset();
+                    is_antiprompt = false;
+                    this->SendState(GenerationState::Generating);
                 }
     
                 // Add tokens to embd only if the input buffer is non-empty
@@ -512,7 +708,7 @@ bool Model::GenerateOutput(std::string prompt) {
                         embd_inp.insert(embd_inp.end(), inp_pfx.begin(), inp_pfx.end());
                     }
 
-                    auto line_inp = ::llama_tokenize(ctx, buffer, false);
+                    auto line_inp = this->Tokenize(buffer, false);
                     embd_inp.insert(embd_inp.end(), line_inp.begin(), line_inp.end());
                         
                     // instruct mode: insert response suffix
@@ -550,15 +746,420 @@ bool Model::GenerateOutput(std::string prompt) {
     
     llama_print_timings(ctx);
     
-    this->busy = false;
-    this->webview->GetBrowser()->RunScript("generationStopped();");
+    this->FlushOutput();
+    this->SetIdle();
+    this->SendState(GenerationState::Stopped);
+    
+    return true;
+}
+
+
+// sends generated text to the UI and checks it for reverse prompts
+// bytes which may start an antiprompt are held back until they can be resolved, when an
+// antiprompt is found it's dropped from the output so the UI never sees it
+// returns true if an antiprompt was found
+bool Model::OutputText(std::string_view text) {
+    if (this->antiprompt_matcher.Empty()) {
+        this->SendOutput(text);
+        return false;
+    }
+    
+    for (char c : text) {
+        this->held_output += c;
+        int match = this->antiprompt_matcher.Feed(c);
+        if (match >= 0) {
+            size_t length = this->antiprompt_matcher.GetLength(match);
+            LOG_S(INFO) << "Antiprompt found: " << this->antiprompt_matcher.GetPattern(match);
+            this->held_output.resize(this->held_output.size() - length);
+            this->FlushOutput();
+            return true;
+        }
+    }
+    
+    // release everything which can't be a part of an antiprompt anymore
+    size_t n_release = this->held_output.size() - this->antiprompt_matcher.GetDepth();
+    if (n_release > 0) {
+        this->SendOutput(std::string_view(this->held_output).substr(0, n_release));
+        this->held_output.erase(0, n_release);
+    }
+    return false;
+}
+
+
+// sends held back output to the UI
+void Model::FlushOutput(void) {
+    if (this->held_output.size() > 0)
+        this->SendOutput(this->held_output);
+    this->held_output.clear();
+    this->antiprompt_matcher.Reset();
+    this->utf8.Reset(); // reply can't end in the middle of a character
+}
+
+
+// evaluates tokens at position n_past and keeps track of what is in the KV cache
+// background evals wait until evals of the other characters' replies have been run
+bool Model::Evaluate(const llama_token *tokens, int n_tokens, int n_past, bool background) {
+    // rows from n_past onwards are overwritten, they are hidden from other models before that
+    this->TruncateEvaluated(n_past);
+    auto t_start = std::chrono::steady_clock::now();
+    if (!DecodeEngine::Eval(this->ctx, tokens, n_tokens, n_past, this->params.n_threads, background))
+        return false;
+    
+    // speed of single token evals is different, they aren't used for sizing prompt chunks
+    if (!background && n_tokens >= MIN_EVAL_CHUNK) {
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+        this->ms_per_token = this->ms_per_token > 0 ? 0.5*(this->ms_per_token + ms/n_tokens) : ms/n_tokens;
+    }
+    
+    std::lock_guard<std::mutex> lock(this->kv_mutex);
+    if ((int) this->evaluated_tokens.size() == n_past) // otherwise earlier rows are unknown
+        this->evaluated_tokens.insert(this->evaluated_tokens.end(), tokens, tokens + n_tokens);
+    return true;
+}
+
+
+/**
+ * Tokenizes text line by line and caches the tokens of each line, so that when the whole
+ * conversation is sent again only new messages are tokenized. Fixed strings such as the
+ * names are tokenized once after the model has been loaded.
+ */
+std::vector<llama_token> Model::Tokenize(const std::string &text, bool add_bos) {
+    if (!this->split_lines)
+        return ::llama_tokenize(this->ctx, text, add_bos);
+    
+    std::vector<llama_token> tokens;
+    if (add_bos)
+        tokens.push_back(llama_token_bos());
+    for (size_t begin = 0; begin < text.size(); ) {
+        size_t end = text.find('\n', begin);
+        end = (end == std::string::npos) ? text.size() : end + 1;
+        std::string line = text.substr(begin, end - begin);
+        
+        auto it = this->token_cache.find(line);
+        if (it == this->token_cache.end()) {
+            if (this->token_cache.size() >= TOKEN_CACHE_LINES)
+                this->token_cache.clear();
+            it = this->token_cache.emplace(line, ::llama_tokenize(this->ctx, line, false)).first;
+        }
+        tokens.insert(tokens.end(), it->second.begin(), it->second.end());
+        begin = end;
+    }
+    return tokens;
+}
+
+
+// newlines are byte tokens in the llama vocabulary and never merge with the text around
+// them, other vocabularies may differ and are tokenized as a whole
+bool Model::CheckLineSplit(void) {
+    const std::vector<std::string> lines = {" User: Hi.\n", "Bob: Hello!\n", "\n", "x"};
+    std::string text;
+    std::vector<llama_token> tokens;
+    for (const auto &line : lines) {
+        auto line_tokens = ::llama_tokenize(this->ctx, line, false);
+        tokens.insert(tokens.end(), line_tokens.begin(), line_tokens.end());
+        text += line;
+    }
+    bool ok = (tokens == ::llama_tokenize(this->ctx, text, false));
+    if (!ok)
+        LOG_S(WARNING) << "Vocabulary merges newlines, prompts are tokenized as a whole";
+    return ok;
+}
+
+
+// returns how many prompt tokens to evaluate at a time to stay within eval_chunk_ms
+int Model::GetChunkSize(void) {
+    const int n_batch = std::max(1, this->params.n_batch);
+    if (this->config->eval_chunk_ms <= 0 || this->ms_per_token <= 0)
+        return n_batch;
+    int n_chunk = (int) (this->config->eval_chunk_ms/this->ms_per_token);
+    return std::clamp(n_chunk, std::min(MIN_EVAL_CHUNK, n_batch), n_batch);
+}
+
+
+// blocks while generation is paused, returns false if it has been stopped
+bool Model::WaitWhilePaused(void) {
+    if (this->pause.test()) {
+        std::unique_lock<std::mutex> lock(this->state_mutex);
+        this->state_cv.wait(lock, [this] { return !this->pause.test() || this->regen_request; });
+    }
+    return !this->stop.test();
+}
+
+
+// regen can interrupt a reply, it's checked between chunks and after every sampled token
+bool Model::GetRegenRequest(void) {
+    std::lock_guard<std::mutex> lock(this->state_mutex);
+    return this->regen_request;
+}
+
+
+// forgets KV rows from n_past onwards, must be called before the rows are overwritten
+void Model::TruncateEvaluated(int n_past) {
+    std::lock_guard<std::mutex> lock(this->kv_mutex);
+    if ((int) this->evaluated_tokens.size() > n_past)
+        this->evaluated_tokens.resize(std::max(n_past, 0));
+}
+
+
+/**
+ * Copies KV rows of the longest prefix of tokens which another model using the same weights
+ * has already evaluated, so that a base prompt shared by characters is evaluated only once.
+ * @param n_reuse number of tokens which are already in this context
+ * @return number of tokens in this context after copying
+ */
+int Model::CopyPrefixFromPeers(const std::vector<llama_token> &tokens, int n_reuse) {
+    // last token must be evaluated to get the logits
+    const int n_max = (int) tokens.size() - 1;
+    
+    std::lock_guard<std::mutex> lock(peers_mutex);
+    Model *best = nullptr;
+    int n_best = n_reuse;
+    for (Model *peer : peers) {
+        if (peer == this)
+            continue;
+        std::lock_guard<std::mutex> peer_lock(peer->kv_mutex);
+        if (peer->evaluated_tokens.empty() || peer->model != this->model)
+            continue;
+        
+        int n = 0;
+        while (n < std::min((int) peer->evaluated_tokens.size(), n_max) && peer->evaluated_tokens[n] == tokens[n])
+            n++;
+        if (n > n_best) {
+            best = peer;
+            n_best = n;
+        }
+    }
+    if (best == nullptr)
+        return n_reuse;
+    
+    // rows after n_reuse are overwritten, peers must not copy them meanwhile
+    this->TruncateEvaluated(n_reuse);
+    {
+        std::lock_guard<std::mutex> peer_lock(best->kv_mutex);
+        n_best = std::min(n_best, (int) best->evaluated_tokens.size()); // may have been truncated
+        if (n_best <= n_reuse || !ContextSnapshot::CopyKV(best->ctx, this->ctx, n_reuse, n_best))
+            return n_reuse;
+    }
+    
+    std::lock_guard<std::mutex> kv_lock(this->kv_mutex);
+    if ((int) this->evaluated_tokens.size() == n_reuse)
+        this->evaluated_tokens.insert(this->evaluated_tokens.end(), tokens.begin() + n_reuse, tokens.begin() + n_best);
+    LOG_S(INFO) << "Copied KV rows of " << n_best - n_reuse << " tokens from char " << best->char_index;
+    return n_best;
+}
+
+
+/**
+ * Evaluates the part of the next input which is already known while waiting for it, e.g.
+ * messages of the other characters, so that the reply can start without evaluating them.
+ * State before it is stored for regeneration the same way as when input arrives.
+ * @param text beginning of the next input, includes the text of the earlier calls
+ * @param embd tokens waiting for evaluation, they are evaluated first
+ */
+bool Model::Prefill(const std::string &text, std::vector<llama_token> &embd) {
+    if (this->params.instruct)
+        return false;
+    if (text.compare(0, this->prefilled.size(), this->prefilled) != 0) // earlier messages have changed
+        this->DropPrefill(embd);
+    if (text.size() == this->prefilled.size())
+        return true;
+    
+    bool first = this->prefilled.empty();
+    std::string new_text = text.substr(this->prefilled.size());
+    auto tokens = this->Tokenize((first ? this->params.input_prefix : "") + new_text, false);
+    size_t n_text = tokens.size();
+    tokens.insert(tokens.begin(), embd.begin(), embd.end());
+    if (this->n_past + (int) tokens.size() > llama_n_ctx(this->ctx))
+        return false; // context swap is left for the generation loop
+    
+    if (first) {
+        this->prefill_snapshot.Save(this->ctx, this->n_past);
+        this->prefill_last_n_tokens = this->last_n_tokens;
+        this->prefill_pending = embd;
+        this->branches->AddNode("");
+    }
+    
+    // small batches, so that the current speaker doesn't wait long for its next token
+    const int n_batch = std::min(this->params.n_batch, DEFAULT_PREFILL_BATCH);
+    for (int i = 0; i < (int) tokens.size(); i += n_batch) {
+        // stop, regen and branch switches drop the prefill anyway, new input usually starts with it
+        bool interrupted;
+        {
+            std::lock_guard<std::mutex> lock(this->state_mutex);
+            interrupted = this->stop.test() || this->regen_request || this->branch_request != 0;
+        }
+        if (interrupted) {
+            LOG_S(INFO) << "Prefill of char " << this->char_index << " interrupted";
+            this->prefilled = text; // everything is dropped, input is evaluated normally
+            this->DropPrefill(embd);
+            return false;
+        }
+        
+        int n_eval = std::min((int) tokens.size() - i, n_batch);
+        if (!this->Evaluate(&tokens[i], n_eval, this->n_past, true)) {
+            LOG_S(ERROR) << "Failed to eval when prefilling";
+            this->prefilled = text; // everything is dropped, input is evaluated normally
+            this->DropPrefill(embd);
+            return false;
+        }
+        this->n_past += n_eval;
+        this->n_evaluated += n_eval;
+        this->branches->AddTokens(&tokens[i], n_eval);
+    }
+    // sampled tokens have been added already, only the text is new
+    for (size_t i = tokens.size() - n_text; i < tokens.size(); i++)
+        this->last_n_tokens.PushBack(tokens[i]);
+    embd.clear();
+    
+    this->prefilled = text;
+    LOG_S(INFO) << "Prefilled " << tokens.size() << " tokens for char " << this->char_index;
+    return true;
+}
+
+
+// returns to the state before Prefill, used when the input isn't what was expected
+void Model::DropPrefill(std::vector<llama_token> &embd) {
+    if (this->prefilled.empty())
+        return;
     
+    this->branches->SetCurrent(this->branches->GetNode(this->branches->GetCurrent()).parent);
+    this->TruncateEvaluated(this->prefill_snapshot.GetNPast());
+    this->n_past = this->prefill_snapshot.Restore(this->ctx);
+    this->last_n_tokens = this->prefill_last_n_tokens;
+    embd = this->prefill_pending;
+    this->prefilled.clear();
+    LOG_S(INFO) << "Dropped prefilled input of char " << this->char_index;
+}
+
+
+// queues the beginning of the next input for Prefill, ignored unless waiting for input
+bool Model::PrefillInput(std::string text) {
+    {
+        std::lock_guard<std::mutex> lock(this->state_mutex);
+        if (!this->waiting_input)
+            return false;
+        this->prefill_request = text;
+    }
+    this->state_cv.notify_all();
+    return true;
+}
+
+
+// sends output to the UI and stores it to the current branch
+// characters split over several tokens are sent when they are complete
+void Model::SendOutput(std::string_view text) {
+    std::string complete = this->utf8.Feed(text);
+    if (complete.empty())
+        return;
+    this->branches->AddOutput(complete);
+    for (auto sink : this->sinks)
+        sink->OnOutput(this->speaker, complete);
+}
+
+
+void Model::SendState(GenerationState state) {
+    for (auto sink : this->sinks)
+        sink->OnStateChange(this->speaker, state);
+}
+
+
+/**
+ * Makes node id of the branch tree current, called by the generation thread while it's
+ * waiting for input. KV rows of the nodes after the common ancestor are restored from
+ * checkpoints if they exist, otherwise they are recomputed.
+ * @param embd tokens waiting for evaluation, replaced by the ones of the selected node
+ */
+bool Model::SelectBranch(int id, std::vector<llama_token> &embd) {
+    int current = this->branches->GetCurrent();
+    if (id == current)
+        return true;
+    
+    BranchNode &target = this->branches->GetNode(id);
+    if (!target.finished) {
+        LOG_S(WARNING) << "Can't select a branch which hasn't been generated";
+        return false;
+    }
+    
+    // save the current node, so that we can come back to it without recomputing
+    this->branches->SaveCheckpoint(this->ctx, current);
+    
+    std::vector<int> path = this->branches->GetPath(id);
+    std::vector<int> current_path = this->branches->GetPath(current);
+    size_t n_common = 0;
+    while (n_common < path.size() && n_common < current_path.size() &&
+           path[n_common] == current_path[n_common])
+        n_common++;
+    
+    if (n_common == path.size()) { // target is an ancestor, its KV rows are intact
+        ContextSnapshot *checkpoint = this->branches->GetCheckpoint(id);
+        if (checkpoint) {
+            this->TruncateEvaluated(target.GetNPastEnd());
+            checkpoint->Restore(this->ctx, false);
+        } else if (target.tokens.size() > 0) { // only logits are needed
+            int n_end = target.GetNPastEnd();
+            if (!this->Evaluate(&target.tokens.back(), 1, n_end - 1)) {
+                LOG_S(ERROR) << "Failed to eval when selecting branch " << id;
+                return false;
+            }
+        }
+    } else {
+        for (size_t i = n_common; i < path.size(); i++) {
+            BranchNode &node = this->branches->GetNode(path[i]);
+            ContextSnapshot *checkpoint = this->branches->GetCheckpoint(path[i]);
+            
+            if (checkpoint && checkpoint->GetKVFrom() == node.n_past_begin) {
+                this->TruncateEvaluated(node.n_past_begin);
+                checkpoint->Restore(this->ctx);
+                std::lock_guard<std::mutex> lock(this->kv_mutex);
+                if ((int) this->evaluated_tokens.size() == node.n_past_begin)
+                    this->evaluated_tokens.insert(this->evaluated_tokens.end(), node.tokens.begin(), node.tokens.end());
+                continue;
+            }
+            
+            LOG_S(INFO) << "Recomputing " << node.tokens.size() << " tokens of branch " << path[i];
+            int n_eval = 0;
+            for (int k = 0; k < (int) node.tokens.size(); k += n_eval) {
+                if (this->stop.test())
+                    return false;
+                n_eval = std::min((int) node.tokens.size() - k, this->GetChunkSize());
+                if (!this->Evaluate(&node.tokens[k], n_eval, node.n_past_begin + k)) {
+                    LOG_S(ERROR) << "Failed to eval when selecting branch " << id;
+                    return false;
+                }
+            }
+        }
+    }
+    
+    this->n_past = target.GetNPastEnd();
+    this->last_n_tokens = target.last_n_tokens;
+    this->old_input = target.input;
+    embd = target.pending;
+    this->branches->SetCurrent(id);
+    
+    for (auto sink : this->sinks)
+        sink->OnReplyReplaced(this->speaker, target.output);
+    return true;
+}
+
+
+// selects previous (-1) or next (1) alternative of the last reply
+bool Model::SwitchBranch(int direction) {
+    std::lock_guard<std::mutex> lock(this->state_mutex);
+    if (!this->waiting_input) {
+        LOG_S(WARNING) << "Can't switch replies while generating";
+        return false;
+    }
+    
+    // the sibling is looked up by the generation thread, which may be prefilling meanwhile
+    this->branch_request = direction < 0 ? -1 : 1;
+    this->state_cv.notify_all();
     return true;
 }
 
 
 // pauses or resumes generation (toggles this->pause)
 bool Model::ToggleGeneration(void) {
+    std::unique_lock<std::mutex> lock(this->state_mutex);
     if (!this->busy) { // can't pause if we aren't generating
         LOG_S(WARNING) << "Toggle generation called but we aren't generating";
         return false;
@@ -566,10 +1167,13 @@ bool Model::ToggleGeneration(void) {
     
     if (this->pause.test()) { // Resuming, clear
         this->pause.clear();
-        this->webview->GetBrowser()->RunScript("generating();");
+        lock.unlock();
+        this->state_cv.notify_all();
+        this->SendState(GenerationState::Generating);
     } else { // Pausing, set pause flag
         this->pause.test_and_set();
-        this->webview->GetBrowser()->RunScript("generationPaused();");
+        lock.unlock();
+        this->SendState(GenerationState::Paused);
     }
     return true;
 }
@@ -577,8 +1181,14 @@ bool Model::ToggleGeneration(void) {
 
 // stops generation (sets stop = true)
 bool Model::StopGeneration(void) {
-    this->pause.clear(); // we must unpause to stop generation properly
-    this->stop.test_and_set();
+    {
+        std::lock_guard<std::mutex> lock(this->state_mutex);
+        if (this->busy && !this->stop.test())
+            this->t_stop = std::chrono::steady_clock::now();
+        this->pause.clear(); // we must unpause to stop generation properly
+        this->stop.test_and_set();
+    }
+    this->state_cv.notify_all();
     return true;
 }
 
@@ -586,60 +1196,151 @@ bool Model::StopGeneration(void) {
 // adds user input from UI for the generation thread to use
 bool Model::AddUserInput(std::string input) {
     // TODO: check for busy status
-    LOG_S(INFO) << "Adding input for char " << this->char_index << " (" <<
-        this->config->char_names[this->char_index] << "):\n" << input;
-    this->new_input_mutex.lock();
-    this->new_input = input;
-    this->new_input_mutex.unlock();
+    LOG_S(INFO) << "Adding input for char " << this->speaker << " (" <<
+        this->config->char_names[this->speaker] << "):\n" << input;
+    {
+        std::lock_guard<std::mutex> lock(this->state_mutex);
+        this->new_input = input;
+    }
+    this->state_cv.notify_all();
     return true;
 }
 
 
 // regenerates reply
 bool Model::RegenerateOutput() {
-    if (!this->busy) {
-        LOG_S(WARNING) << "Regenerate called but we aren't generating";
-        return false;
+    bool first_reply; // n_outputs counts finished replies
+    {
+        std::lock_guard<std::mutex> lock(this->state_mutex);
+        if (!this->busy) {
+            LOG_S(WARNING) << "Regenerate called but we aren't generating";
+            return false;
+        }
+        first_reply = this->n_outputs == (this->waiting_input ? 1 : 0);
     }
     
     uint32_t tmp_seed = std::random_device()();
     LOG_S(INFO) << "Using seed: " << tmp_seed << " for regen";
-        
-    if (this->n_outputs == 1) { // generate everything from scratch
+    
+    if (first_reply) { // generate everything from scratch
         this->StopGeneration();
-        while (this->GetBusy())
-            sleep(0.1);
+        this->WaitUntilIdle();
 
-        this->ctx->rng = std::mt19937(tmp_seed); // create new rng
+        llama_set_rng_seed(this->ctx, tmp_seed); // create new rng
+        for (auto sink : this->sinks) // generation thread has finished, it can't call the sinks
+            sink->OnReplyDiscarded(this->speaker);
         
-        std::thread thread(&Model::GenerateOutput, this, this->old_input);
-        thread.detach();
+        this->StartGeneration(this->old_input);
         
     } else { // we already have generated second output
-        // restore old state, it contains RNG state therefore it must be restored first
-        llama_set_state_data(this->ctx, this->old_state.data());
-        
-        this->ctx->rng.seed(tmp_seed);
-        this->n_past = this->old_n_past;
-        this->last_n_tokens = this->old_last_n_tokens;
-        this->AddUserInput(this->old_input);
+        // context belongs to the generation thread, it may be generating or prefilling meanwhile
+        {
+            std::lock_guard<std::mutex> lock(this->state_mutex);
+            this->regen_seed = tmp_seed;
+            this->regen_request = true;
+        }
+        this->state_cv.notify_all();
     }
 
     return true;
 }
 
 
+// returns to the state before the last input for regenerating the reply to it
+void Model::RestoreOldState(uint32_t seed) {
+    // keep the current reply as a branch which can be selected later
+    int current = this->branches->GetCurrent();
+    if (current >= 0 && this->branches->GetNode(current).parent >= 0) {
+        this->branches->SaveCheckpoint(this->ctx, current);
+        this->branches->SetCurrent(this->branches->GetNode(current).parent);
+    }
+    
+    // restore old state, it contains RNG state therefore it must be restored first
+    // tokens of the rows written back from the snapshot aren't known
+    int kv_from = this->old_snapshot.GetKVFrom();
+    this->TruncateEvaluated(kv_from >= 0 ? kv_from : this->old_snapshot.GetNPast());
+    this->n_past = this->old_snapshot.Restore(this->ctx);
+    
+    llama_set_rng_seed(this->ctx, seed);
+    this->last_n_tokens = this->old_last_n_tokens;
+    for (auto sink : this->sinks)
+        sink->OnReplyDiscarded(this->speaker);
+}
+
+
 bool Model::GetBusy(void) {
+    std::lock_guard<std::mutex> lock(this->state_mutex);
     return this->busy;
 }
 
+
+// blocks until the generation thread has finished
+void Model::WaitUntilIdle(void) {
+    std::unique_lock<std::mutex> lock(this->state_mutex);
+    this->state_cv.wait(lock, [this] { return !this->busy; });
+}
+
+
+// marks generation as finished and wakes up threads waiting for it
+void Model::SetIdle(void) {
+    {
+        std::lock_guard<std::mutex> lock(this->state_mutex);
+        this->busy = false;
+        if (this->stop.test()) {
+            this->cancel_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - this->t_stop).count();
+            LOG_S(INFO) << "Generation of char " << this->char_index << " stopped in " << this->cancel_ms << " ms";
+        }
+    }
+    this->state_cv.notify_all();
+}
+
 bool Model::GetPause(void) {
     return this->pause.test();
 }
 
 
-void Model::SetWebview(Webview *new_webview) {
-    this->webview = new_webview;
+// selects the character whose reply is generated next, used when characters share the model
+void Model::SetSpeaker(int char_index) {
+    this->speaker = char_index;
+}
+
+
+int Model::GetNEvaluated(void) {
+    return this->n_evaluated;
+}
+
+
+int Model::GetNSampled(void) {
+    return this->n_sampled;
+}
+
+
+int Model::GetNDrafted(void) {
+    return this->n_drafted;
+}
+
+
+int Model::GetNAccepted(void) {
+    return this->n_accepted;
+}
+
+
+// time from StopGeneration until the generation thread finished, -1 if it wasn't stopped
+double Model::GetCancelLatency(void) {
+    std::lock_guard<std::mutex> lock(this->state_mutex);
+    return this->cancel_ms;
+}
+
+
+// sinks must not be added or removed while generating
+void Model::AddSink(TokenSink *sink) {
+    if (sink && std::find(this->sinks.begin(), this->sinks.end(), sink) == this->sinks.end())
+        this->sinks.push_back(sink);
+}
+
+
+void Model::RemoveSink(TokenSink *sink) {
+    this->sinks.erase(std::remove(this->sinks.begin(), this->sinks.end(), sink), this->sinks.end());
 }
 
 
@@ -1,16 +1,21 @@
 #ifndef MODEL_H
 #define MODEL_H
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <filesystem>
 #include <iostream>
 #include <mutex>
+#include <random>
+#include <string_view>
+#include <unordered_map>
+#include <thread>
 #include <vector>
 
 #include <unistd.h>
 
-#include <wx/log.h> 
-
 #include "loguru.hpp"
 
 #include "examples/common.h"
@@ -18,8 +23,23 @@
 #include "llama.h"
 #include "llama-util.h"
 
-#include "webview.h"
 #include "config.h"
+#include "antiprompt.h"
+#include "branchtree.h"
+#include "decodeengine.h"
+#include "drafter.h"
+#include "promptcache.h"
+#include "registry.h"
+#include "ringbuffer.h"
+#include "sampler.h"
+#include "scheduler.h"
+#include "snapshot.h"
+#include "tokensink.h"
+#include "utils.h"
+#include "vocab.h"
+
+#define MIN_EVAL_CHUNK 32 // smaller prompt evals don't use BLAS
+#define TOKEN_CACHE_LINES 4096 // tokenized lines are forgotten when there are more
 
 /*
 #ifndef LLAMA_VOCAB
@@ -41,14 +61,16 @@ struct llama_vocab {
 
 class Model {
 public:
-    explicit Model(Webview *webview, Config *config, int char_index = 0);
+    explicit Model(TokenSink *sink, Config *config, int char_index = 0);
     ~Model();
     
-    bool LoadModel(std::string model_path);
+    bool LoadModel(std::string model_path, std::string draft_path = "", llama_progress_callback progress = nullptr,
+                   void *progress_data = nullptr);
     
     gpt_params GetGPTParams(void); 
     bool SetGPTParams(gpt_params new_params, bool update_seed = false, uint32_t *new_seed = 0);
     
+    bool StartGeneration(std::string prompt);
     bool GenerateOutput(std::string prompt);
     bool RegenerateOutput(void);
 
@@ -56,43 +78,105 @@ public:
     bool StopGeneration(void);
     
     bool AddUserInput(std::string input);
+    bool SwitchBranch(int direction);
+    bool PrefillInput(std::string text);
+    void SetSpeaker(int char_index);
     
     bool GetBusy(void);
     bool GetPause(void);
+    int GetNEvaluated(void);
+    int GetNSampled(void);
+    int GetNDrafted(void);
+    int GetNAccepted(void);
+    double GetCancelLatency(void);
+    void WaitUntilIdle(void);
     
-    void SetWebview(Webview *new_webview);
+    void AddSink(TokenSink *sink);
+    void RemoveSink(TokenSink *sink);
     
 private:
+    bool OutputText(std::string_view text);
+    void FlushOutput(void);
+    void SendOutput(std::string_view text);
+    void SendState(GenerationState state);
+    std::vector<llama_token> Tokenize(const std::string &text, bool add_bos);
+    bool CheckLineSplit(void);
+    bool Evaluate(const llama_token *tokens, int n_tokens, int n_past, bool background = false);
+    int GetChunkSize(void);
+    bool WaitWhilePaused(void);
+    bool GetRegenRequest(void);
+    void TruncateEvaluated(int n_past);
+    int CopyPrefixFromPeers(const std::vector<llama_token> &tokens, int n_reuse);
+    bool SelectBranch(int id, std::vector<llama_token> &embd);
+    bool Prefill(const std::string &text, std::vector<llama_token> &embd);
+    void DropPrefill(std::vector<llama_token> &embd);
+    void RestoreOldState(uint32_t seed);
+    void SetIdle(void);
     void PrintGPTParams(); // used for printing debug information
     //void PrintPrompt(); // prints prompt and associated token ids
     
     gpt_params params;
+    llama_model *model = nullptr; // shared weights, owned by ModelRegistry
     llama_context *ctx = nullptr;
+    Sampler sampler;
+    Drafter *drafter = nullptr; // proposes tokens for speculative decoding, optional
+    Vocab vocab; // token strings, built when the model is loaded
+    std::unordered_map<std::string, std::vector<llama_token>> token_cache; // line => its tokens
+    bool split_lines = false; // text can be tokenized line by line
     
     std::string old_input;
-    std::vector<uint8_t> old_state;
+    ContextSnapshot old_snapshot; // state before the last input, used for regeneration
     int n_past = 0;
-    int old_n_past = 0;
-    std::vector<llama_token> last_n_tokens;
-    std::vector<llama_token> old_last_n_tokens;
-    int n_outputs; // how many outputs we have generated
+    RingBuffer<llama_token> last_n_tokens;
+    RingBuffer<llama_token> old_last_n_tokens;
+    int n_outputs; // how many outputs we have generated, guarded by state_mutex
+    BranchTree *branches = nullptr; // all generated replies, used for switching between them
+    PromptCache prompt_cache; // KV state of the static prompt on disk
+    
+    std::string prefilled; // beginning of the next input which has been evaluated already
+    ContextSnapshot prefill_snapshot; // state before prefilling
+    RingBuffer<llama_token> prefill_last_n_tokens;
+    std::vector<llama_token> prefill_pending; // embd before prefilling
     
-    inline static Webview *webview; // used for communication with the HTML UI
+    AntipromptMatcher antiprompt_matcher;
+    std::string held_output; // output which may be a beginning of an antiprompt
+    Utf8Assembler utf8; // sinks receive only complete characters
+    
+    std::vector<TokenSink*> sinks; // receivers of the output, e.g. the webview
     inline static Config *config; // pointer to config class
+    inline static std::atomic<uint32_t> n_created = 0; // models created so far, keeps spill files apart
     
     bool is_interacting = false;
+    // control state shared with the UI thread, changes are signaled through state_cv
     bool busy = false;
     std::atomic_flag stop = ATOMIC_FLAG_INIT;
     std::atomic_flag pause = ATOMIC_FLAG_INIT;
-    
     std::string new_input;
-    std::mutex new_input_mutex;
+    bool waiting_input = false;
+    int branch_request = 0; // direction of the sibling the generation thread should switch to, 0 = none
+    std::string prefill_request; // text for Prefill
+    bool regen_request = false; // restore the state before the last input and evaluate it again
+    uint32_t regen_seed = 0;
+    std::chrono::steady_clock::time_point t_stop; // when the running generation was asked to stop
+    double cancel_ms = -1; // how long the last stop took, -1 = not stopped
+    std::mutex state_mutex;
+    std::condition_variable state_cv;
 
     int n_consumed;
+    std::atomic<int> n_evaluated = 0; // token counters for benchmarking
+    std::atomic<int> n_sampled = 0;
+    std::atomic<int> n_drafted = 0; // tokens proposed by the draft model
+    std::atomic<int> n_accepted = 0; // ... and accepted by the main model
+    double ms_per_token = 0; // measured speed of prompt evals, 0 = unknown
     int char_index; // which character this models handles? 0 - first character
+    std::atomic<int> speaker; // character whose reply is generated, differs only with shared context
         
     inline static console_state con_st;
-    std::vector<llama_token> evaluated_tokens;
+    std::vector<llama_token> evaluated_tokens; // tokens in the KV cache, by position
+    std::mutex kv_mutex; // guards evaluated_tokens and the rows they cover against peers
+    
+    inline static std::vector<Model*> peers; // all models, used for sharing KV rows
+    inline static std::mutex peers_mutex;
 };
 
 #endif // MODEL_H
@@ -0,0 +1,64 @@
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+#include <atomic>
+#include <utility>
+
+/**
+ * Unbounded lock-free queue with multiple producers and a single consumer (Vyukov's
+ * linked list). Push is a single atomic exchange, so producers never wait for each other
+ * or for the consumer. A pushed element may become visible to Pop only after the producer
+ * has linked it, Pop returns false until then.
+ */
+template <typename T>
+class MpscQueue {
+public:
+    MpscQueue() {
+        Node *stub = new Node();
+        this->head = stub;
+        this->tail = stub;
+    }
+
+    ~MpscQueue() {
+        T value;
+        while (this->Pop(value));
+        delete this->tail;
+    }
+
+    MpscQueue(const MpscQueue &) = delete;
+    MpscQueue &operator=(const MpscQueue &) = delete;
+
+    // can be called from any thread
+    void Push(T value) {
+        Node *node = new Node(std::move(value));
+        Node *prev = this->head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    // must be called only from the consumer thread
+    bool Pop(T &value) {
+        Node *tail = this->tail;
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if (next == nullptr)
+            return false;
+
+        value = std::move(next->value);
+        this->tail = next; // next becomes the new stub
+        delete tail;
+        return true;
+    }
+
+private:
+    struct Node {
+        std::atomic<Node *> next = nullptr;
+        T value;
+
+        Node() = default;
+        explicit Node(T value) : value(std::move(value)) {}
+    };
+
+    std::atomic<Node *> head; // last pushed node
+    Node *tail; // stub node, the next one is the oldest element
+};
+
+#endif // MPSCQUEUE_H
@@ -0,0 +1,109 @@
+#include "promptcache.h"
+
+namespace fs = std::filesystem;
+
+
+// FNV-1a, only used for naming the cache files
+static uint64_t Hash(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+
+static uint64_t Hash(uint64_t hash, const std::string &s) {
+    return Hash(hash, s.data(), s.size() + 1); // include terminator to separate fields
+}
+
+
+void PromptCache::SetDir(const std::string &dir) {
+    this->dir = dir;
+}
+
+
+bool PromptCache::Enabled(void) {
+    return !this->dir.empty();
+}
+
+
+// file name depends on everything which affects the KV cache
+std::string PromptCache::GetPath(const gpt_params &params, const std::vector<llama_token> &tokens, int n_tokens) {
+    std::error_code ec;
+    uint64_t file_size = fs::file_size(params.model, ec);
+    int64_t file_time = fs::last_write_time(params.model, ec).time_since_epoch().count();
+    int f16_kv = params.memory_f16;
+
+    uint64_t hash = 0xcbf29ce484222325;
+    hash = Hash(hash, fs::absolute(params.model, ec).string());
+    hash = Hash(hash, &file_size, sizeof(file_size));
+    hash = Hash(hash, &file_time, sizeof(file_time));
+    hash = Hash(hash, &params.n_ctx, sizeof(params.n_ctx));
+    hash = Hash(hash, &f16_kv, sizeof(f16_kv));
+    hash = Hash(hash, params.lora_adapter);
+    hash = Hash(hash, params.lora_base);
+    hash = Hash(hash, &n_tokens, sizeof(n_tokens));
+    hash = Hash(hash, tokens.data(), n_tokens*sizeof(llama_token));
+
+    char name[32];
+    snprintf(name, sizeof(name), "prompt-%016llx.bin", (unsigned long long) hash);
+    return (fs::path(this->dir) / name).string();
+}
+
+
+// checks if the first n_tokens tokens have been cached
+bool PromptCache::Contains(const gpt_params &params, const std::vector<llama_token> &tokens, int n_tokens) {
+    if (!this->Enabled() || n_tokens <= 0 || n_tokens > (int) tokens.size())
+        return false;
+    return fs::exists(this->GetPath(params, tokens, n_tokens));
+}
+
+
+// restores KV rows of the first n_tokens tokens, returns false if they aren't cached
+bool PromptCache::Load(llama_context *ctx, const gpt_params &params, const std::vector<llama_token> &tokens, int n_tokens) {
+    if (!this->Contains(params, tokens, n_tokens))
+        return false;
+
+    std::string path = this->GetPath(params, tokens, n_tokens);
+
+    if (ContextSnapshot::RestoreFile(ctx, path) != n_tokens) {
+        LOG_S(WARNING) << "Invalid prompt cache file, removing: " << path;
+        std::error_code ec;
+        fs::remove(path, ec);
+        return false;
+    }
+    LOG_S(INFO) << "Loaded " << n_tokens << " prompt tokens from cache: " << path;
+    return true;
+}
+
+
+// stores KV rows of the first n_tokens tokens, they must have been evaluated already
+bool PromptCache::Store(llama_context *ctx, const gpt_params &params, const std::vector<llama_token> &tokens, int n_tokens) {
+    if (!this->Enabled() || n_tokens <= 0 || n_tokens > (int) tokens.size())
+        return false;
+
+    std::error_code ec;
+    fs::create_directories(this->dir, ec);
+
+    ContextSnapshot snapshot;
+    snapshot.Save(ctx, n_tokens);
+    snapshot.SaveKV(ctx, 0);
+
+    // write to a temporary file first so that other instances never see a partial file
+    std::string path = this->GetPath(params, tokens, n_tokens);
+    std::string tmp_path = path + "." + std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id())) + ".tmp";
+    if (!snapshot.WriteFile(tmp_path)) {
+        LOG_S(ERROR) << "Error writing prompt cache: " << tmp_path;
+        fs::remove(tmp_path, ec);
+        return false;
+    }
+    fs::rename(tmp_path, path, ec);
+    if (ec) {
+        LOG_S(ERROR) << "Error writing prompt cache: " << path << ": " << ec.message();
+        return false;
+    }
+    LOG_S(INFO) << "Stored " << n_tokens << " prompt tokens to cache: " << path;
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef PROMPTCACHE_H
+#define PROMPTCACHE_H
+
+#include <filesystem>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "loguru.hpp"
+
+#include "examples/common.h"
+#include "llama.h"
+
+#include "snapshot.h"
+
+/**
+ * On-disk cache of the KV state after the static part of the prompt (n_keep tokens).
+ * Files are keyed by the model file, context parameters and the prompt tokens, so
+ * restarting with the same character doesn't evaluate its prompt again.
+ */
+class PromptCache {
+public:
+    void SetDir(const std::string &dir);
+    bool Enabled(void);
+    bool Contains(const gpt_params &params, const std::vector<llama_token> &tokens, int n_tokens);
+
+    bool Load(llama_context *ctx, const gpt_params &params, const std::vector<llama_token> &tokens, int n_tokens);
+    bool Store(llama_context *ctx, const gpt_params &params, const std::vector<llama_token> &tokens, int n_tokens);
+
+private:
+    std::string GetPath(const gpt_params &params, const std::vector<llama_token> &tokens, int n_tokens);
+
+    std::string dir; // empty = disabled
+};
+
+#endif // PROMPTCACHE_H
@@ -0,0 +1,97 @@
+#include "registry.h"
+
+
+// builds a key from everything that affects the loaded weights, n_ctx is included since
+// llama.cpp stores it to the model hparams and uses it for sizing the KV cache
+std::string ModelRegistry::GetKey(const gpt_params &params, const llama_context_params &lparams) {
+    return params.model + "|" + std::to_string(lparams.n_ctx) + "|" +
+        std::to_string(lparams.n_gpu_layers) + "|" + std::to_string(lparams.use_mmap) + "|" +
+        std::to_string(lparams.use_mlock) + "|" + params.lora_adapter + "|" + params.lora_base;
+}
+
+
+// returns model for the given parameters, loads it if it isn't loaded yet
+// returns nullptr on error
+llama_model *ModelRegistry::Acquire(const gpt_params &params, const llama_context_params &lparams) {
+    std::unique_lock<std::mutex> lock(mutex);
+    std::string key = GetKey(params, lparams);
+
+    auto it = models.find(key);
+    if (it != models.end()) {
+        if (it->second.loading) { // someone else is loading the same model, wait for it
+            cv.wait(lock, [&key] {
+                auto it = models.find(key);
+                return it == models.end() || !it->second.loading;
+            });
+            it = models.find(key);
+            if (it == models.end()) // loading failed
+                return nullptr;
+        }
+        it->second.refs++;
+        LOG_S(INFO) << "Reusing loaded model: " << params.model << " (refs: " << it->second.refs << ")";
+        return it->second.model;
+    }
+
+    Entry placeholder;
+    placeholder.loading = true;
+    models[key] = placeholder;
+    lock.unlock();
+    llama_model *model = Load(params, lparams);
+    lock.lock();
+
+    if (model == nullptr)
+        models.erase(key);
+    else
+        models[key] = Entry{model, 1, false};
+    lock.unlock();
+    cv.notify_all();
+    return model;
+}
+
+
+// loads the weights and applies the lora adapter, returns nullptr on error
+llama_model *ModelRegistry::Load(const gpt_params &params, const llama_context_params &lparams) {
+    llama_model *model = nullptr;
+    try {
+        model = llama_load_model_from_file(params.model.c_str(), lparams);
+    } catch (...) {
+        LOG_S(ERROR) << "Error loading model: " << params.model;
+        return nullptr;
+    }
+    if (model == nullptr) {
+        LOG_S(ERROR) << "Failed to load model: " << params.model;
+        return nullptr;
+    }
+
+    // lora modifies weights, therefore it's applied once to the shared model
+    if (!params.lora_adapter.empty()) {
+        int err = llama_model_apply_lora_from_file(model, params.lora_adapter.c_str(),
+                                                   params.lora_base.empty() ? NULL : params.lora_base.c_str(),
+                                                   params.n_threads);
+        if (err != 0) {
+            LOG_S(ERROR) << "Failed to apply lora adapter: " << params.lora_adapter;
+            llama_free_model(model);
+            return nullptr;
+        }
+    }
+    return model;
+}
+
+
+// decreases reference count of the model and frees it when it isn't used anymore
+// all contexts created from the model must be freed before calling this
+void ModelRegistry::Release(llama_model *model) {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    for (auto it = models.begin(); it != models.end(); it++) {
+        if (!it->second.loading && it->second.model == model) {
+            if (--it->second.refs == 0) {
+                LOG_S(INFO) << "Freeing model: " << it->first;
+                llama_free_model(model);
+                models.erase(it);
+            }
+            return;
+        }
+    }
+    LOG_S(WARNING) << "Trying to release a model that isn't in the registry";
+}
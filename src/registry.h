@@ -0,0 +1,40 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "loguru.hpp"
+
+#include "examples/common.h"
+#include "llama.h"
+
+/**
+ * Process-wide registry of loaded model weights. Each Model owns its own llama_context
+ * but the weights are loaded only once per model file and reference counted, so adding
+ * characters doesn't multiply startup time and memory usage. Models are loaded outside
+ * the lock, other models can be acquired and released meanwhile.
+ */
+class ModelRegistry {
+public:
+    static llama_model *Acquire(const gpt_params &params, const llama_context_params &lparams);
+    static void Release(llama_model *model);
+
+private:
+    static llama_model *Load(const gpt_params &params, const llama_context_params &lparams);
+    static std::string GetKey(const gpt_params &params, const llama_context_params &lparams);
+
+    struct Entry {
+        llama_model *model = nullptr;
+        int refs = 0;
+        bool loading = false; // placeholder until the load finishes, model is still nullptr
+    };
+
+    inline static std::map<std::string, Entry> models; // key => loaded model
+    inline static std::mutex mutex;
+    inline static std::condition_variable cv; // signaled when a load finishes
+};
+
+#endif // REGISTRY_H
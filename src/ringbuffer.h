@@ -0,0 +1,74 @@
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * Fixed-capacity ring buffer which always holds exactly capacity elements (oldest are
+ * overwritten). Every element is stored twice so that the window from the oldest to the
+ * newest element is always contiguous in memory, which allows passing it directly to
+ * llama.cpp samplers. PushBack is O(1).
+ */
+template <typename T>
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity = 0, T value = T()) {
+        this->Reset(capacity, value);
+    }
+
+    // resizes the buffer and fills the window with value
+    void Reset(size_t capacity, T value = T()) {
+        this->capacity = capacity;
+        this->head = 0;
+        this->buffer.assign(2 * capacity, value);
+    }
+
+    // appends value to the end of the window, oldest element is dropped
+    void PushBack(T value) {
+        if (this->capacity == 0)
+            return;
+        this->buffer[this->head] = value;
+        this->buffer[this->head + this->capacity] = value;
+        this->head++;
+        if (this->head == this->capacity)
+            this->head = 0;
+    }
+
+    // undoes the last PushBack, oldest is the element it dropped from the front of the window
+    void PopBack(T oldest) {
+        if (this->capacity == 0)
+            return;
+        this->head = (this->head == 0 ? this->capacity : this->head) - 1;
+        this->buffer[this->head] = oldest;
+        this->buffer[this->head + this->capacity] = oldest;
+    }
+
+    // returns pointer to the contiguous window, oldest element first
+    const T *Data() const {
+        return this->buffer.data() + this->head;
+    }
+
+    size_t Size() const {
+        return this->capacity;
+    }
+
+    const T &Back() const {
+        return this->Data()[this->capacity - 1];
+    }
+
+    const T *begin() const {
+        return this->Data();
+    }
+
+    const T *end() const {
+        return this->Data() + this->capacity;
+    }
+
+private:
+    std::vector<T> buffer;
+    size_t capacity = 0;
+    size_t head = 0; // position of the oldest element
+};
+
+#endif // RINGBUFFER_H
@@ -0,0 +1,112 @@
+#include "sampler.h"
+
+
+// allocates buffers for the vocabulary of the context, SetParams must be called after this
+void Sampler::SetContext(llama_context *ctx) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->ctx = ctx;
+    this->n_vocab = llama_n_vocab(ctx);
+    this->candidates.resize(this->n_vocab);
+}
+
+
+void Sampler::SetParams(const gpt_params &params) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    bool reset = (params.mirostat != this->params.mirostat) ||
+                 (params.mirostat_tau != this->params.mirostat_tau);
+    this->params = params;
+    
+    this->logit_bias.assign(this->n_vocab, 0.0f);
+    this->biased_tokens.clear();
+    for (auto& [token, bias] : params.logit_bias) {
+        if (token < 0 || token >= this->n_vocab)
+            continue;
+        if (this->logit_bias[token] == 0.0f)
+            this->biased_tokens.push_back(token);
+        this->logit_bias[token] += bias;
+    }
+    
+    if (reset)
+        this->mirostat_mu = 2.0f * this->params.mirostat_tau;
+}
+
+
+void Sampler::Reset(void) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->mirostat_mu = 2.0f * this->params.mirostat_tau;
+}
+
+
+// samples next token from the current logits of the context
+// last_tokens contains n_last_tokens previous tokens used for the penalties
+// row selects the token of the last eval whose logits are used, -1 = last token
+llama_token Sampler::Sample(const llama_token *last_tokens, int n_last_tokens, int row) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    const float   temp            = params.temp;
+    const int32_t top_k           = params.top_k <= 0 ? this->n_vocab : params.top_k;
+    const float   top_p           = params.top_p;
+    const float   tfs_z           = params.tfs_z;
+    const float   typical_p       = params.typical_p;
+    const int32_t repeat_last_n   = params.repeat_last_n < 0 ? n_last_tokens : params.repeat_last_n;
+    const float   repeat_penalty  = params.repeat_penalty;
+    const float   alpha_presence  = params.presence_penalty;
+    const float   alpha_frequency = params.frequency_penalty;
+    const int     mirostat        = params.mirostat;
+    const float   mirostat_tau    = params.mirostat_tau;
+    const float   mirostat_eta    = params.mirostat_eta;
+    const bool    penalize_nl     = params.penalize_nl;
+
+    const int n_rows = ContextSnapshot::GetNLogits(this->ctx);
+    if (row < 0 || row >= n_rows)
+        row = n_rows - 1;
+    const float *logits = llama_get_logits(this->ctx) + (size_t) row*this->n_vocab;
+    
+    // fill candidates, biases are applied to candidates so logits of the context stay intact
+    llama_token_data *data = this->candidates.data();
+    for (llama_token token_id = 0; token_id < this->n_vocab; token_id++) {
+        data[token_id] = llama_token_data{token_id, logits[token_id], 0.0f};
+    }
+    for (llama_token token_id : this->biased_tokens) {
+        data[token_id].logit += this->logit_bias[token_id];
+    }
+
+    llama_token_data_array candidates_p = { data, this->candidates.size(), false };
+
+    // Apply penalties
+    const llama_token nl = llama_token_nl();
+    const float nl_logit = data[nl].logit;
+    auto last_n_repeat = std::min(n_last_tokens, repeat_last_n);
+    llama_sample_repetition_penalty(this->ctx, &candidates_p,
+        last_tokens + n_last_tokens - last_n_repeat,
+        last_n_repeat, repeat_penalty);
+    llama_sample_frequency_and_presence_penalties(this->ctx, &candidates_p,
+        last_tokens + n_last_tokens - last_n_repeat,
+        last_n_repeat, alpha_frequency, alpha_presence);
+    if (!penalize_nl) { // candidates aren't sorted yet, so index equals token id
+        data[nl].logit = nl_logit;
+    }
+
+    llama_token id = 0;
+    if (temp <= 0) {
+        // Greedy sampling
+        id = llama_sample_token_greedy(this->ctx, &candidates_p);
+    } else {
+        if (mirostat == 1) {
+            const int mirostat_m = 100;
+            llama_sample_temperature(this->ctx, &candidates_p, temp);
+            id = llama_sample_token_mirostat(this->ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &this->mirostat_mu);
+        } else if (mirostat == 2) {
+            llama_sample_temperature(this->ctx, &candidates_p, temp);
+            id = llama_sample_token_mirostat_v2(this->ctx, &candidates_p, mirostat_tau, mirostat_eta, &this->mirostat_mu);
+        } else {
+            // Temperature sampling
+            llama_sample_top_k(this->ctx, &candidates_p, top_k, 1);
+            llama_sample_tail_free(this->ctx, &candidates_p, tfs_z, 1);
+            llama_sample_typical(this->ctx, &candidates_p, typical_p, 1);
+            llama_sample_top_p(this->ctx, &candidates_p, top_p, 1);
+            llama_sample_temperature(this->ctx, &candidates_p, temp);
+            id = llama_sample_token(this->ctx, &candidates_p);
+        }
+    }
+    return id;
+}
@@ -0,0 +1,39 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <mutex>
+#include <vector>
+
+#include "examples/common.h"
+#include "llama.h"
+
+#include "snapshot.h"
+
+/**
+ * Sampling pipeline of a single Model. Candidate buffer and logit biases are allocated
+ * once per context instead of on every token, and mirostat state is kept per instance
+ * so that characters don't share it. SetParams can be called by the UI thread while the
+ * generation thread samples.
+ */
+class Sampler {
+public:
+    void SetContext(llama_context *ctx);
+    void SetParams(const gpt_params &params);
+    void Reset(void); // resets mirostat state
+
+    llama_token Sample(const llama_token *last_tokens, int n_last_tokens, int row = -1);
+
+private:
+    std::mutex mutex; // guards the members below
+    llama_context *ctx = nullptr;
+    int n_vocab = 0;
+
+    gpt_params params;
+    std::vector<llama_token_data> candidates;
+    std::vector<float> logit_bias; // dense, indexed by token id
+    std::vector<llama_token> biased_tokens; // tokens with non-zero bias
+    
+    float mirostat_mu = 0.0f;
+};
+
+#endif // SAMPLER_H
@@ -0,0 +1,153 @@
+#include "scheduler.h"
+
+
+/**
+ * Starts the worker pool, called again when the configuration changes. All jobs must
+ * have finished before the pool is resized.
+ * @param n_workers number of jobs which can run at the same time, 0 = n_sessions
+ * @param n_sessions number of Models, each of them needs its own worker
+ * @param max_threads cores shared by the evals, 0 = all cores
+ */
+void Scheduler::Start(int n_workers, int n_sessions, int max_threads) {
+    if (max_threads <= 0)
+        max_threads = std::max(1, (int) std::thread::hardware_concurrency());
+    if (n_workers > 0 && n_workers < n_sessions) // later sessions would never start
+        LOG_S(WARNING) << "Scheduler: " << n_workers << " workers are too few for " << n_sessions << " sessions";
+    n_workers = std::max({1, n_workers, n_sessions});
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Scheduler::max_threads = max_threads;
+        if ((int) workers.size() == n_workers)
+            return;
+    }
+    Stop();
+
+    std::lock_guard<std::mutex> lock(mutex);
+    stopping = false;
+    for (int i = 0; i < n_workers; i++)
+        workers.push_back(std::thread(WorkerLoop));
+    LOG_S(INFO) << "Scheduler: " << n_workers << " workers, " << max_threads << " threads";
+}
+
+
+// stops the workers after their current jobs, queued jobs are dropped
+void Scheduler::Stop(void) {
+    std::vector<std::thread> old_workers;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        old_workers.swap(workers);
+        queue.clear();
+    }
+    cv.notify_all();
+    for (auto &worker : old_workers)
+        worker.join();
+}
+
+
+void Scheduler::Submit(const void *owner, std::function<void(void)> run) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(Job{owner, run, Clock::now()});
+    }
+    cv.notify_all();
+}
+
+
+// drops queued jobs of the owner and waits until its running job has finished
+void Scheduler::Cancel(const void *owner) {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.erase(std::remove_if(queue.begin(), queue.end(),
+                               [owner](const Job &job) { return job.owner == owner; }), queue.end());
+    cv.wait(lock, [owner] { return !IsRunning(owner); });
+}
+
+
+/**
+ * Returns how many threads an eval may use, EndEval must be called with them after the eval.
+ * Cores are split between the evals running at the same time: an eval gets its share of
+ * the cores which aren't in use yet and waits while all of them are taken.
+ * @param n_threads threads requested by the job
+ * @param exclusive evals are run one at a time, so each may use all cores
+ */
+int Scheduler::BeginEval(int n_threads, bool exclusive) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (max_threads <= 0 || exclusive) {
+        evaluating++;
+        return max_threads <= 0 ? n_threads : std::max(1, std::min(n_threads, max_threads));
+    }
+    eval_cv.wait(lock, [] { return threads_in_use < max_threads; });
+    evaluating++;
+    int budget = std::min(max_threads/evaluating, max_threads - threads_in_use);
+    budget = std::max(1, std::min(n_threads, budget));
+    threads_in_use += budget;
+    return budget;
+}
+
+
+void Scheduler::EndEval(int n_threads, bool exclusive) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        evaluating--;
+        if (max_threads <= 0 || exclusive)
+            return;
+        threads_in_use -= n_threads;
+    }
+    eval_cv.notify_all();
+}
+
+
+SchedulerStats Scheduler::GetStats(void) {
+    std::lock_guard<std::mutex> lock(mutex);
+    SchedulerStats s = stats;
+    s.queued = (int) queue.size();
+    s.running = (int) running.size();
+    s.evaluating = evaluating;
+    return s;
+}
+
+
+bool Scheduler::IsRunning(const void *owner) {
+    return std::find(running.begin(), running.end(), owner) != running.end();
+}
+
+
+// takes the oldest job whose owner isn't busy, mutex must be held
+bool Scheduler::PopRunnable(Job &job) {
+    for (auto it = queue.begin(); it != queue.end(); it++) {
+        if (IsRunning(it->owner))
+            continue;
+        job = std::move(*it);
+        queue.erase(it);
+        return true;
+    }
+    return false;
+}
+
+
+void Scheduler::WorkerLoop(void) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        Job job;
+        while (!stopping && !PopRunnable(job))
+            cv.wait(lock);
+        if (stopping)
+            return;
+
+        double wait_ms = std::chrono::duration<double, std::milli>(Clock::now() - job.t_submit).count();
+        stats.n_jobs++;
+        stats.wait_ms += wait_ms;
+        stats.max_wait_ms = std::max(stats.max_wait_ms, wait_ms);
+        running.push_back(job.owner);
+        LOG_S(INFO) << "Starting job after " << wait_ms << " ms in queue, running: " << running.size() <<
+            ", queued: " << queue.size();
+
+        lock.unlock();
+        job.run();
+        job.run = nullptr; // release captured state outside the lock
+        lock.lock();
+
+        running.erase(std::find(running.begin(), running.end(), job.owner));
+        cv.notify_all(); // owner may have queued jobs, Cancel may be waiting
+    }
+}
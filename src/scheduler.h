@@ -0,0 +1,72 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "loguru.hpp"
+
+struct SchedulerStats {
+    int queued = 0; // jobs waiting for a worker
+    int running = 0;
+    int evaluating = 0; // running jobs which are in an eval right now
+    uint64_t n_jobs = 0; // jobs started
+    double wait_ms = 0; // total time started jobs spent in the queue
+    double max_wait_ms = 0;
+};
+
+
+/**
+ * Runs generation jobs on a fixed pool of worker threads. A job is the whole generation
+ * session of a Model and runs until the Model is stopped, so the pool must have a worker
+ * for every Model. Jobs of the same owner run one at a time in submission order. Evals
+ * share max_threads cores: DecodeEngine caps the threads of every eval to the budget
+ * given by BeginEval and an eval waits while all cores are taken, so characters can't
+ * oversubscribe the CPU. Sessions which wait for input don't take a share.
+ */
+class Scheduler {
+public:
+    static void Start(int n_workers, int n_sessions, int max_threads);
+    static void Stop(void);
+
+    static void Submit(const void *owner, std::function<void(void)> run);
+    static void Cancel(const void *owner);
+
+    static int BeginEval(int n_threads, bool exclusive);
+    static void EndEval(int n_threads, bool exclusive);
+    static SchedulerStats GetStats(void);
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Job {
+        const void *owner = nullptr;
+        std::function<void(void)> run;
+        Clock::time_point t_submit;
+    };
+
+    static void WorkerLoop(void);
+    static bool PopRunnable(Job &job);
+    static bool IsRunning(const void *owner);
+
+    inline static std::mutex mutex;
+    inline static std::condition_variable cv;
+    inline static std::deque<Job> queue;
+    inline static std::vector<const void *> running; // owners of the running jobs
+    inline static int evaluating = 0;
+    inline static int threads_in_use = 0; // threads given to the running parallel evals
+    inline static std::condition_variable eval_cv; // signaled when an eval gives its threads back
+    inline static std::vector<std::thread> workers;
+    inline static bool stopping = false;
+    inline static int max_threads = 0; // 0 = no limit
+    inline static SchedulerStats stats;
+};
+
+#endif // SCHEDULER_H
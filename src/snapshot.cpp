@@ -0,0 +1,279 @@
+// KV cache is accessed directly, this must be the only file including llama.cpp
+#include "llama.cpp" // this contains struct definitions for some reason??
+#define LLAMA_VOCAB
+#include "snapshot.h"
+
+
+// stores state needed to continue generation from n_past, this doesn't copy the KV cache
+// with logits_all only the last row of logits is kept, it's the only one sampled after Restore
+void ContextSnapshot::Save(llama_context *ctx, int n_past) {
+    const size_t n_vocab = ctx->model.hparams.n_vocab;
+    this->n_past = n_past;
+    this->rng = ctx->rng;
+    if (ctx->logits.size() > n_vocab)
+        this->logits.assign(ctx->logits.end() - n_vocab, ctx->logits.end());
+    else
+        this->logits = ctx->logits;
+    this->kv_from = -1;
+    this->k.clear();
+    this->v.clear();
+}
+
+
+// copies KV rows [from, n_past) of the snapshot, called before they are overwritten
+// does nothing if rows have already been saved
+void ContextSnapshot::SaveKV(llama_context *ctx, int from) {
+    if (this->n_past < 0 || this->kv_from >= 0 || from >= this->n_past)
+        return;
+
+    const auto &hparams = ctx->model.hparams;
+    const auto &kv_self = ctx->kv_self;
+    const size_t n_ctx  = hparams.n_ctx;
+    const size_t n_embd = hparams.n_embd;
+    const size_t n_rows = this->n_past - from;
+    const size_t k_size = ggml_element_size(kv_self.k);
+    const size_t v_size = ggml_element_size(kv_self.v);
+
+    this->kv_from = from;
+    this->k.resize(hparams.n_layer * n_rows * n_embd * k_size);
+    this->v.resize(hparams.n_layer * n_rows * n_embd * v_size);
+
+    uint8_t *k_dst = this->k.data();
+    uint8_t *v_dst = this->v.data();
+    for (size_t il = 0; il < hparams.n_layer; il++) {
+        // K rows of a layer are contiguous: [n_ctx][n_embd]
+        const uint8_t *k_src = (uint8_t *) kv_self.k->data + (il*n_ctx + from)*n_embd*k_size;
+        memcpy(k_dst, k_src, n_rows*n_embd*k_size);
+        k_dst += n_rows*n_embd*k_size;
+
+        // V is stored transposed: [n_embd][n_ctx]
+        for (size_t e = 0; e < n_embd; e++) {
+            const uint8_t *v_src = (uint8_t *) kv_self.v->data + ((il*n_embd + e)*n_ctx + from)*v_size;
+            memcpy(v_dst, v_src, n_rows*v_size);
+            v_dst += n_rows*v_size;
+        }
+    }
+    LOG_S(INFO) << "Saved " << n_rows << " KV rows to snapshot (" << this->GetSize() << " bytes)";
+}
+
+
+// copies n_rows KV rows starting from row "from" to the cache, source is in SaveKV layout
+static void WriteKV(llama_context *ctx, int from, size_t n_rows, const uint8_t *k_src, const uint8_t *v_src) {
+    const auto &hparams = ctx->model.hparams;
+    auto &kv_self = ctx->kv_self;
+    const size_t n_ctx  = hparams.n_ctx;
+    const size_t n_embd = hparams.n_embd;
+    const size_t k_size = ggml_element_size(kv_self.k);
+    const size_t v_size = ggml_element_size(kv_self.v);
+
+    for (size_t il = 0; il < hparams.n_layer; il++) {
+        uint8_t *k_dst = (uint8_t *) kv_self.k->data + (il*n_ctx + from)*n_embd*k_size;
+        memcpy(k_dst, k_src, n_rows*n_embd*k_size);
+        k_src += n_rows*n_embd*k_size;
+
+        for (size_t e = 0; e < n_embd; e++) {
+            uint8_t *v_dst = (uint8_t *) kv_self.v->data + ((il*n_embd + e)*n_ctx + from)*v_size;
+            memcpy(v_dst, v_src, n_rows*v_size);
+            v_src += n_rows*v_size;
+        }
+    }
+}
+
+
+// restores the context and truncates the KV cache, returns n_past of the snapshot or -1
+// if write_kv is false, saved KV rows aren't written back (they are known to be intact)
+int ContextSnapshot::Restore(llama_context *ctx, bool write_kv) {
+    if (this->n_past < 0)
+        return -1;
+
+    ctx->rng = this->rng;
+    ctx->logits = this->logits;
+
+    if (write_kv && this->kv_from >= 0) // write back overwritten rows
+        WriteKV(ctx, this->kv_from, this->n_past - this->kv_from, this->k.data(), this->v.data());
+    ctx->kv_self.n = this->n_past;
+
+    return this->n_past;
+}
+
+
+/**
+ * Restores the context from a file written by WriteFile without loading the snapshot.
+ * The file is memory mapped and KV rows are copied straight to the cache. RNG isn't
+ * restored, the context keeps its own seed.
+ * @return n_past of the snapshot or -1 on error
+ */
+int ContextSnapshot::RestoreFile(llama_context *ctx, const std::string &path) {
+    if (!llama_mmap::SUPPORTED) { // read the whole file instead
+        ContextSnapshot snapshot;
+        if (!snapshot.ReadFile(path))
+            return -1;
+        snapshot.rng = ctx->rng;
+        return snapshot.Restore(ctx);
+    }
+
+    try {
+        llama_file file(path.c_str(), "rb");
+        llama_mmap mapping(&file);
+        const uint8_t *data = (const uint8_t *) mapping.addr;
+
+        int header[2]; // n_past, kv_from
+        size_t sizes[4];
+        if (mapping.size < sizeof(header) + sizeof(sizes))
+            return -1;
+        memcpy(header, data, sizeof(header));
+        memcpy(sizes, data + sizeof(header), sizeof(sizes));
+
+        const auto &hparams = ctx->model.hparams;
+        const int n_past = header[0], kv_from = header[1];
+        const size_t n_rows = n_past - kv_from;
+        const size_t k_bytes = hparams.n_layer*n_rows*hparams.n_embd*ggml_element_size(ctx->kv_self.k);
+        const size_t v_bytes = hparams.n_layer*n_rows*hparams.n_embd*ggml_element_size(ctx->kv_self.v);
+        const size_t offset = sizeof(header) + sizeof(sizes) + sizes[0];
+
+        // older files may contain logits of the whole last batch, only the last row is used
+        if (kv_from < 0 || n_past > (int) hparams.n_ctx || sizes[1] == 0 || sizes[1] % hparams.n_vocab != 0 ||
+            sizes[2] != k_bytes || sizes[3] != v_bytes ||
+            mapping.size < offset + sizes[1]*sizeof(float) + sizes[2] + sizes[3]) {
+            LOG_S(WARNING) << "Snapshot doesn't match the context: " << path;
+            return -1;
+        }
+
+        const float *logits = (const float *) (data + offset);
+        ctx->logits.assign(logits + sizes[1] - hparams.n_vocab, logits + sizes[1]);
+        const uint8_t *k_src = data + offset + sizes[1]*sizeof(float);
+        WriteKV(ctx, kv_from, n_rows, k_src, k_src + sizes[2]);
+        ctx->kv_self.n = n_past;
+        return n_past;
+
+    } catch (const std::exception &e) {
+        LOG_S(ERROR) << "Error mapping snapshot " << path << ": " << e.what();
+        return -1;
+    }
+}
+
+
+/**
+ * Copies KV rows [from, to) between contexts of the same model, rows of a token depend only
+ * on the tokens before it so they are valid in any context with the same prefix.
+ * @return false if the contexts have different layout
+ */
+bool ContextSnapshot::CopyKV(llama_context *src, llama_context *dst, int from, int to) {
+    const auto &hparams = src->model.hparams;
+    const auto &dst_hparams = dst->model.hparams;
+    const auto &src_kv = src->kv_self;
+    auto &dst_kv = dst->kv_self;
+    const size_t k_size = ggml_element_size(src_kv.k);
+    const size_t v_size = ggml_element_size(src_kv.v);
+
+    if (hparams.n_ctx != dst_hparams.n_ctx || hparams.n_embd != dst_hparams.n_embd ||
+        hparams.n_layer != dst_hparams.n_layer || k_size != ggml_element_size(dst_kv.k) ||
+        v_size != ggml_element_size(dst_kv.v) || from < 0 || to > (int) hparams.n_ctx || from >= to)
+        return false;
+
+    const size_t n_ctx  = hparams.n_ctx;
+    const size_t n_embd = hparams.n_embd;
+    const size_t n_rows = to - from;
+    for (size_t il = 0; il < hparams.n_layer; il++) {
+        const size_t k_offset = (il*n_ctx + from)*n_embd*k_size;
+        memcpy((uint8_t *) dst_kv.k->data + k_offset, (uint8_t *) src_kv.k->data + k_offset, n_rows*n_embd*k_size);
+
+        for (size_t e = 0; e < n_embd; e++) {
+            const size_t v_offset = ((il*n_embd + e)*n_ctx + from)*v_size;
+            memcpy((uint8_t *) dst_kv.v->data + v_offset, (uint8_t *) src_kv.v->data + v_offset, n_rows*v_size);
+        }
+    }
+    dst_kv.n = to;
+    return true;
+}
+
+
+// 1 unless the context was created with logits_all, then one row per token of the last eval
+int ContextSnapshot::GetNLogits(llama_context *ctx) {
+    return (int) (ctx->logits.size()/ctx->model.hparams.n_vocab);
+}
+
+
+void ContextSnapshot::Clear(void) {
+    this->n_past = -1;
+    this->kv_from = -1;
+    this->logits.clear();
+    this->k.clear();
+    this->v.clear();
+}
+
+
+// writes snapshot to the file, used for moving snapshots out of memory
+bool ContextSnapshot::WriteFile(const std::string &path) {
+    std::ofstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    std::stringstream rng_ss;
+    rng_ss << this->rng;
+    std::string rng_s = rng_ss.str();
+    
+    size_t sizes[4] = {rng_s.size(), this->logits.size(), this->k.size(), this->v.size()};
+    file.write((const char *) &this->n_past, sizeof(this->n_past));
+    file.write((const char *) &this->kv_from, sizeof(this->kv_from));
+    file.write((const char *) sizes, sizeof(sizes));
+    file.write(rng_s.data(), rng_s.size());
+    file.write((const char *) this->logits.data(), this->logits.size()*sizeof(float));
+    file.write((const char *) this->k.data(), this->k.size());
+    file.write((const char *) this->v.data(), this->v.size());
+    
+    return file.good();
+}
+
+
+bool ContextSnapshot::ReadFile(const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+
+    size_t sizes[4];
+    file.read((char *) &this->n_past, sizeof(this->n_past));
+    file.read((char *) &this->kv_from, sizeof(this->kv_from));
+    file.read((char *) sizes, sizeof(sizes));
+    if (!file.good()) {
+        this->Clear();
+        return false;
+    }
+
+    std::string rng_s(sizes[0], '\0');
+    this->logits.resize(sizes[1]);
+    this->k.resize(sizes[2]);
+    this->v.resize(sizes[3]);
+    file.read(rng_s.data(), rng_s.size());
+    file.read((char *) this->logits.data(), this->logits.size()*sizeof(float));
+    file.read((char *) this->k.data(), this->k.size());
+    file.read((char *) this->v.data(), this->v.size());
+    if (!file.good()) {
+        this->Clear();
+        return false;
+    }
+    
+    std::stringstream rng_ss(rng_s);
+    rng_ss >> this->rng;
+    return true;
+}
+
+
+bool ContextSnapshot::IsValid(void) {
+    return this->n_past >= 0;
+}
+
+
+int ContextSnapshot::GetNPast(void) {
+    return this->n_past;
+}
+
+
+int ContextSnapshot::GetKVFrom(void) {
+    return this->kv_from;
+}
+
+
+size_t ContextSnapshot::GetSize(void) {
+    return sizeof(this->rng) + this->logits.size()*sizeof(float) + this->k.size() + this->v.size();
+}
@@ -0,0 +1,50 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "loguru.hpp"
+
+#include "llama.h"
+
+/**
+ * Snapshot of a llama_context at token position n_past, used for regenerating replies.
+ * Generation only appends to the KV cache, so rows below n_past stay valid and aren't
+ * copied when the snapshot is taken. They are copied only when a context swap is about
+ * to overwrite them (SaveKV), and restoring truncates the cache back to n_past.
+ */
+class ContextSnapshot {
+public:
+    void Save(llama_context *ctx, int n_past);
+    void SaveKV(llama_context *ctx, int from);
+    int Restore(llama_context *ctx, bool write_kv = true);
+    void Clear(void);
+
+    bool WriteFile(const std::string &path);
+    bool ReadFile(const std::string &path);
+    static int RestoreFile(llama_context *ctx, const std::string &path);
+    static bool CopyKV(llama_context *src, llama_context *dst, int from, int to);
+    static int GetNLogits(llama_context *ctx); // rows of logits kept from the last eval
+
+    bool IsValid(void);
+    int GetNPast(void);
+    int GetKVFrom(void); // first saved KV row or -1 if KV hasn't been saved
+    size_t GetSize(void); // bytes used by the snapshot
+
+private:
+    int n_past = -1; // -1 = no snapshot
+    std::mt19937 rng;
+    std::vector<float> logits;
+
+    // copy of the KV rows [kv_from, n_past) if they have been overwritten
+    int kv_from = -1;
+    std::vector<uint8_t> k;
+    std::vector<uint8_t> v;
+};
+
+#endif // SNAPSHOT_H
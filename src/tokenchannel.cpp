@@ -0,0 +1,110 @@
+#include "tokenchannel.h"
+
+
+/**
+ * Creates a channel and starts flushing it periodically
+ * @param browser webview where the output is sent
+ * @param flush_interval flush interval in milliseconds
+ */
+TokenChannel::TokenChannel(wxWebView *browser, int flush_interval) {
+    this->browser = browser;
+    this->alive = std::make_shared<bool>(true);
+    this->SetInterval(flush_interval);
+}
+
+
+// must be called from the main thread after the producers have stopped
+TokenChannel::~TokenChannel() {
+    this->Stop();
+    *this->alive = false; // pending CallAfter flushes become no-ops
+}
+
+
+// adds text to be shown by LLMOutput(), can be called from any thread
+void TokenChannel::AddText(const std::string &text) {
+    this->entries.Push(Entry{false, text});
+    size_t pending = this->pending_bytes.fetch_add(text.size()) + text.size();
+    if (pending >= DEFAULT_FLUSH_BYTES || this->flush_interval <= 0)
+        this->RequestFlush();
+}
+
+
+// adds script to be run after the text added so far, can be called from any thread
+void TokenChannel::AddScript(const std::string &script) {
+    this->entries.Push(Entry{true, script});
+    this->RequestFlush(); // scripts change the UI state, don't delay them
+}
+
+
+// sends all pending text and scripts to the webview
+void TokenChannel::Flush(void) {
+    // entries pushed from now on request a new flush
+    this->flush_requested = false;
+    this->pending_bytes = 0;
+    
+    std::string script, text;
+    Entry entry;
+    while (this->entries.Pop(entry)) {
+        if (!entry.is_script) {
+            text += entry.data;
+            continue;
+        }
+        if (text.size() > 0) {
+            this->AppendText(script, text);
+            text.clear();
+        }
+        // one failing script must not prevent the rest of the batch from running
+        script += "try {\n" + entry.data + "\n} catch (e) { console.error(e); }\n";
+    }
+    if (text.size() > 0)
+        this->AppendText(script, text);
+    if (script.empty())
+        return;
+    
+    this->browser->RunScript(wxString::FromUTF8(script));
+    this->n_flushes++;
+}
+
+
+void TokenChannel::AppendText(std::string &script, const std::string &text) {
+    this->n_bytes += text.size();
+    script += "LLMOutput(\"" + utils::CleanStringForJS(text) + "\");\n";
+}
+
+
+// flushes the channel from the main thread as soon as possible
+void TokenChannel::RequestFlush(void) {
+    if (this->flush_requested.exchange(true))
+        return;
+    // alive is read and cleared only on the main thread, the copy keeps it valid for the call
+    std::shared_ptr<bool> alive = this->alive;
+    this->browser->CallAfter([this, alive] {
+        if (*alive)
+            this->Flush();
+    });
+}
+
+
+void TokenChannel::SetInterval(int flush_interval) {
+    this->flush_interval = flush_interval;
+    if (flush_interval <= 0) // flush every token
+        this->Stop();
+    else
+        this->Start(flush_interval, wxTIMER_CONTINUOUS);
+}
+
+
+uint64_t TokenChannel::GetFlushCount(void) {
+    return this->n_flushes;
+}
+
+
+uint64_t TokenChannel::GetByteCount(void) {
+    return this->n_bytes;
+}
+
+
+// called by wxTimer from the main thread
+void TokenChannel::Notify() {
+    this->Flush();
+}
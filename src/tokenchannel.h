@@ -0,0 +1,60 @@
+#ifndef TOKENCHANNEL_H
+#define TOKENCHANNEL_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include <wx/timer.h>
+#include "wx/webview.h"
+
+#include "loguru.hpp"
+
+#include "mpscqueue.h"
+#include "utils.h"
+
+#define DEFAULT_FLUSH_BYTES 4096 // flush immediately if this much text is pending
+
+/**
+ * Buffers generated text and UI scripts from the generation threads and sends them to the
+ * webview from the main thread in frames. Producers only push to a lock-free queue, so they
+ * never wait for the main thread or the browser. Each flush drains the queue into a single
+ * RunScript call: consecutive text is coalesced into one LLMOutput() call, scripts are run
+ * in the order they were added relative to the text.
+ */
+class TokenChannel : public wxTimer {
+public:
+    explicit TokenChannel(wxWebView *browser, int flush_interval);
+    ~TokenChannel();
+    
+    void AddText(const std::string &text);
+    void AddScript(const std::string &script);
+    void Flush(void); // must be called from the main thread
+    
+    void SetInterval(int flush_interval);
+    uint64_t GetFlushCount(void);
+    uint64_t GetByteCount(void);
+    
+    void Notify() override;
+
+private:
+    void RequestFlush(void);
+    void AppendText(std::string &script, const std::string &text);
+
+    struct Entry {
+        bool is_script;
+        std::string data;
+    };
+
+    wxWebView *browser;
+    std::shared_ptr<bool> alive; // flushes queued by CallAfter may run after the channel is deleted
+    std::atomic<int> flush_interval;
+    MpscQueue<Entry> entries;
+    std::atomic<size_t> pending_bytes = 0;
+    std::atomic<bool> flush_requested = false;
+    
+    std::atomic<uint64_t> n_flushes = 0; // number of flushes which sent something
+    std::atomic<uint64_t> n_bytes = 0; // bytes of text sent to the UI
+};
+
+#endif // TOKENCHANNEL_H
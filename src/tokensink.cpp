@@ -0,0 +1,112 @@
+#include "tokensink.h"
+
+
+void CollectorSink::OnOutput(int char_index, const std::string &text) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->output_times.push_back(Clock::now());
+    this->output += text;
+}
+
+
+// only the end of the reply matters here
+void CollectorSink::OnStateChange(int char_index, GenerationState state) {
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (state == GenerationState::WaitingForInput)
+            this->reply_done = true;
+        else if (state == GenerationState::Stopped)
+            this->stopped = true;
+        else
+            return;
+    }
+    this->cv.notify_all();
+}
+
+
+void CollectorSink::OnReplyReplaced(int char_index, const std::string &text) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->output = text;
+}
+
+
+// starts collecting a new reply, call before giving input to the model
+void CollectorSink::Clear(void) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->start_time = Clock::now();
+    this->output_times.clear();
+    this->output.clear();
+    this->reply_done = false;
+}
+
+
+bool CollectorSink::WaitForReply(void) {
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->cv.wait(lock, [this] {
+        return this->reply_done || this->stopped;
+    });
+    return this->reply_done;
+}
+
+
+std::string CollectorSink::GetOutput(void) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->output;
+}
+
+
+std::vector<CollectorSink::Clock::time_point> CollectorSink::GetOutputTimes(void) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->output_times;
+}
+
+
+CollectorSink::Clock::time_point CollectorSink::GetStartTime(void) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->start_time;
+}
+
+
+JsonlSink::JsonlSink(const std::string &path) {
+    this->file.open(path, std::ios::out | std::ios::trunc);
+    if (!this->file.is_open())
+        LOG_S(ERROR) << "Error opening file for output: " << path;
+}
+
+
+bool JsonlSink::IsOpen(void) {
+    return this->file.is_open();
+}
+
+
+void JsonlSink::OnOutput(int char_index, const std::string &text) {
+    this->Write(char_index, "output", text);
+}
+
+
+void JsonlSink::OnStateChange(int char_index, GenerationState state) {
+    static const char *names[] = {"tokenizing", "generating", "paused", "waiting", "stopped"};
+    this->Write(char_index, names[(int) state], "");
+}
+
+
+void JsonlSink::OnReplyReplaced(int char_index, const std::string &text) {
+    this->Write(char_index, "replace", text);
+}
+
+
+void JsonlSink::OnReplyDiscarded(int char_index) {
+    this->Write(char_index, "discard", "");
+}
+
+
+void JsonlSink::Write(int char_index, const char *event, const std::string &text) {
+    double t = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - this->start_time).count();
+    nlohmann::json j = {{"t_ms", t}, {"char_index", char_index}, {"event", event}};
+    if (!text.empty())
+        j["text"] = text;
+
+    // tokens may split multibyte characters, invalid bytes are replaced instead of throwing
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->file.is_open())
+        this->file << j.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace) << "\n";
+}
@@ -0,0 +1,93 @@
+#ifndef TOKENSINK_H
+#define TOKENSINK_H
+
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+
+#include "loguru.hpp"
+
+enum class GenerationState {
+    Tokenizing,
+    Generating,
+    Paused,
+    WaitingForInput,
+    Stopped
+};
+
+
+/**
+ * Receives output and state changes of Models. Called from the generation thread, text is
+ * passed by reference so that several sinks can consume the same output without copies.
+ */
+class TokenSink {
+public:
+    virtual ~TokenSink() {}
+
+    virtual void OnOutput(int char_index, const std::string &text) = 0;
+    virtual void OnStateChange(int char_index, GenerationState state) {}
+    virtual void OnReplyReplaced(int char_index, const std::string &text) {}
+    virtual void OnReplyDiscarded(int char_index) {} // last reply is being regenerated
+};
+
+
+// discards everything, used for benchmarking the engine alone
+class NullSink : public TokenSink {
+public:
+    void OnOutput(int char_index, const std::string &text) override {}
+};
+
+
+// collects timestamped output in memory, can be waited on until a reply is finished
+class CollectorSink : public TokenSink {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    void OnOutput(int char_index, const std::string &text) override;
+    void OnStateChange(int char_index, GenerationState state) override;
+    void OnReplyReplaced(int char_index, const std::string &text) override;
+
+    void Clear(void);
+    bool WaitForReply(void); // returns false if generation was stopped
+    std::string GetOutput(void);
+    std::vector<Clock::time_point> GetOutputTimes(void);
+    Clock::time_point GetStartTime(void);
+
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    Clock::time_point start_time = Clock::now();
+    std::vector<Clock::time_point> output_times;
+    std::string output;
+    bool reply_done = false;
+    bool stopped = false;
+};
+
+
+// writes every event as a JSON line to a file
+class JsonlSink : public TokenSink {
+public:
+    explicit JsonlSink(const std::string &path);
+
+    void OnOutput(int char_index, const std::string &text) override;
+    void OnStateChange(int char_index, GenerationState state) override;
+    void OnReplyReplaced(int char_index, const std::string &text) override;
+    void OnReplyDiscarded(int char_index) override;
+
+    bool IsOpen(void);
+
+private:
+    void Write(int char_index, const char *event, const std::string &text);
+
+    std::mutex mutex; // several models may write to the same file
+    std::ofstream file;
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+};
+
+#endif // TOKENSINK_H
@@ -0,0 +1,186 @@
+#include "transcript.h"
+
+
+Transcript::Transcript(Config *config) {
+    this->config = config;
+}
+
+
+// stores the static part and the example messages of the prompt of the char, parsed by the UI
+void Transcript::SetBase(int char_index, const std::string &base_prompt, const std::vector<std::string> &base_log) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->Resize(char_index + 1);
+    this->base_prompt[char_index] = base_prompt;
+    this->base_log[char_index] = base_log;
+}
+
+
+// adds a message to the end of the conversation, returns its id
+size_t Transcript::Append(const std::string &text) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->AppendLocked(text);
+}
+
+
+/**
+ * Builds the prompt for starting the generation of the char and begins its reply.
+ * @param user_line "user_name:message\n" or empty if the char continues on its own
+ */
+std::string Transcript::BuildPrompt(int char_index, const std::string &user_line) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->Resize(std::max((size_t) this->config->n_chars, (size_t) char_index + 1));
+    this->replies[char_index].clear();
+    this->last_reply[char_index] = SIZE_MAX; // a new reply begins, the old one can't be replaced anymore
+
+    std::string prompt;
+    if (this->config->shared_context) { // all chars are in the same context
+        for (const auto &base : this->base_prompt)
+            prompt += base + "\n";
+        for (const auto &log : this->base_log) {
+            for (size_t i = 0; i < log.size(); i++)
+                prompt += log[i] + (i + 1 < log.size() ? "\n" : "");
+            if (log.size() > 0)
+                prompt += "\n";
+        }
+        return prompt + user_line + this->config->char_names.at(char_index) + ":";
+    }
+
+    const auto &log = this->base_log[char_index];
+    prompt = this->base_prompt[char_index] + "\n";
+    for (size_t i = 0; i < log.size(); i++)
+        prompt += log[i] + (i + 1 < log.size() ? "\n" : "");
+    return prompt + "\n" + user_line;
+}
+
+
+// builds the next input of the char from the messages it hasn't seen and begins its reply
+std::string Transcript::BuildInput(int char_index, const std::string &user_line) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->Resize(std::max((size_t) this->config->n_chars, (size_t) char_index + 1));
+    this->replies[char_index].clear();
+    this->last_reply[char_index] = SIZE_MAX; // a new reply begins, the old one can't be replaced anymore
+
+    std::string name = this->config->char_names.at(char_index) + ":";
+    if (this->config->shared_context) // the model has seen all messages already
+        return user_line + name;
+    return this->JoinFrom(this->last_seen[char_index]) + user_line + name;
+}
+
+
+// messages after the last reply of the char, beginning of its next input
+std::string Transcript::GetUnseen(int char_index) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if ((size_t) char_index >= this->last_seen.size())
+        return "";
+    return this->JoinFrom(this->last_seen[char_index]);
+}
+
+
+// same format as the log saved by the UI before
+json Transcript::ToJSON(void) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    json log = json::array();
+    for (const auto &message : this->messages) {
+        if (!message.deleted)
+            log.push_back({message.time, message.text});
+    }
+    return json{
+        {"base_prompt", this->base_prompt},
+        {"base_log",    this->base_log},
+        {"log",         log}
+    };
+}
+
+
+// TokenSink interface, called by the generation threads
+void Transcript::OnOutput(int char_index, const std::string &text) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->Resize(char_index + 1);
+    this->replies[char_index] += text;
+}
+
+
+// finished replies are added to the conversation
+void Transcript::OnStateChange(int char_index, GenerationState state) {
+    if (state != GenerationState::WaitingForInput && state != GenerationState::Stopped)
+        return;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->Resize(char_index + 1);
+    if (this->replies[char_index].size() > 0) {
+        this->last_reply[char_index] = this->AppendLocked(this->AddName(char_index, this->replies[char_index]));
+        this->replies[char_index].clear();
+    }
+    if (state == GenerationState::WaitingForInput)
+        this->last_seen[char_index] = this->messages.size();
+}
+
+
+void Transcript::OnReplyReplaced(int char_index, const std::string &text) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->Resize(char_index + 1);
+    size_t id = this->last_reply[char_index];
+    if (id < this->messages.size()) {
+        this->messages[id].text = this->AddName(char_index, text);
+        this->messages[id].time = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+}
+
+
+// the reply is removed whether it has been finished or is still being generated
+void Transcript::OnReplyDiscarded(int char_index) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->Resize(char_index + 1);
+    this->replies[char_index].clear();
+    size_t id = this->last_reply[char_index];
+    if (id < this->messages.size())
+        this->messages[id].deleted = true;
+    this->last_reply[char_index] = SIZE_MAX;
+}
+
+
+// mutex must be held by the caller in the functions below
+void Transcript::Resize(size_t n_chars) {
+    if (this->base_prompt.size() >= n_chars)
+        return;
+    this->base_prompt.resize(n_chars);
+    this->base_log.resize(n_chars);
+    this->last_seen.resize(n_chars, 0);
+    this->replies.resize(n_chars);
+    this->last_reply.resize(n_chars, SIZE_MAX);
+}
+
+
+size_t Transcript::AppendLocked(const std::string &text) {
+    TranscriptMessage message;
+    message.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    message.text = text;
+    this->messages.push_back(message);
+    return this->messages.size() - 1;
+}
+
+
+std::string Transcript::JoinFrom(size_t from) {
+    std::string text;
+    bool first = true;
+    for (size_t id = from; id < this->messages.size(); id++) {
+        if (this->messages[id].deleted)
+            continue;
+        if (!first)
+            text += "\n";
+        text += this->messages[id].text;
+        first = false;
+    }
+    return text;
+}
+
+
+// replies are stored as "name:reply" like the other messages
+std::string Transcript::AddName(int char_index, const std::string &text) {
+    if ((size_t) char_index >= this->config->char_names.size())
+        return text;
+    std::string name = this->config->char_names[char_index] + ":";
+    return text.compare(0, name.size(), name) == 0 ? text : name + text;
+}
@@ -0,0 +1,68 @@
+#ifndef TRANSCRIPT_H
+#define TRANSCRIPT_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "nlohmann/json.hpp"
+using json = nlohmann::json;
+
+#include "loguru.hpp"
+
+#include "config.h"
+#include "tokensink.h"
+
+struct TranscriptMessage {
+    int64_t time = 0; // ms since epoch, same as Date.now() in the UI
+    std::string text; // "name: message"
+    bool deleted = false;
+};
+
+
+/**
+ * Conversation of the UI. Messages are only appended, the id of a message is its index,
+ * deleted ones (replies being regenerated) are kept as tombstones so that the ids stay
+ * valid. The UI sends only new user messages, replies are recorded as a TokenSink of the
+ * models. Inputs of the models are built from the messages a character hasn't seen yet,
+ * so a turn costs as much as the new messages regardless of the length of the
+ * conversation.
+ */
+class Transcript : public TokenSink {
+public:
+    explicit Transcript(Config *config);
+
+    void SetBase(int char_index, const std::string &base_prompt, const std::vector<std::string> &base_log);
+    size_t Append(const std::string &text);
+
+    std::string BuildPrompt(int char_index, const std::string &user_line);
+    std::string BuildInput(int char_index, const std::string &user_line);
+    std::string GetUnseen(int char_index);
+    json ToJSON(void);
+
+    void OnOutput(int char_index, const std::string &text) override;
+    void OnStateChange(int char_index, GenerationState state) override;
+    void OnReplyReplaced(int char_index, const std::string &text) override;
+    void OnReplyDiscarded(int char_index) override;
+
+private:
+    void Resize(size_t n_chars);
+    size_t AppendLocked(const std::string &text);
+    std::string JoinFrom(size_t from);
+    std::string AddName(int char_index, const std::string &text);
+
+    Config *config;
+    std::mutex mutex; // replies are recorded by the generation threads
+
+    std::vector<std::string> base_prompt; // static part of the prompt of each char
+    std::vector<std::vector<std::string>> base_log; // example messages of the prompt of each char
+    std::vector<TranscriptMessage> messages;
+    std::vector<size_t> last_seen; // per char, messages before this are in its context
+    std::vector<std::string> replies; // per char, reply being generated
+    std::vector<size_t> last_reply; // per char, id of its last reply or SIZE_MAX
+};
+
+#endif // TRANSCRIPT_H
@@ -27,29 +27,75 @@ bool utils::WriteTextFile(std::string contents, std::string path) {
 }
 
     
+// escape sequences for bytes that are problematic for javascript, nullptr = no escaping
+static const std::array<const char *, 256> js_escape_table = [] {
+    std::array<const char *, 256> table{};
+    table['\n'] = "\\n";
+    table['"']  = "&quot;";
+    table['\''] = "&apos;";
+    table['<']  = "&lt;";
+    table['>']  = "&gt;";
+    return table;
+}();
+
+
 // replaces characters that are problematic for javascript
-std::string utils::CleanStringForJS(std::string input) {
+// single pass over the input, runs of normal characters are copied at once
+std::string utils::CleanStringForJS(const std::string &input) {
     std::string output;
+    output.reserve(input.size() + input.size() / 8);
+
+    const char *data = input.data();
+    size_t n = input.size();
+    size_t start = 0; // beginning of the current run of normal characters
+    for (size_t i = 0; i < n; i++) {
+        const char *escape = js_escape_table[(unsigned char) data[i]];
+        if (escape) {
+            output.append(data + start, i - start);
+            output.append(escape);
+            start = i + 1;
+        }
+    }
+    output.append(data + start, n - start);
 
-    output = std::regex_replace(input, std::regex("\""), "&quot;");
-    output = std::regex_replace(output, std::regex("\'"), "&apos;");
-    output = std::regex_replace(output, std::regex("<"), "&lt;");
-    output = std::regex_replace(output, std::regex(">"), "&gt;");
-    output = std::regex_replace(output, std::regex("\n"), "\\n");
-        
     return output;
 }
-   
-   
+
+
 // converts string received from JS to normal format
-std::string utils::CleanJSString(std::string input) {
+// entities are searched with memchr which is vectorized by the C library
+std::string utils::CleanJSString(const std::string &input) {
+    static const struct {
+        const char *entity;
+        size_t length;
+        char c;
+    } entities[] = {
+        {"&quot;", 6, '"'},
+        {"&apos;", 6, '\''},
+        {"&lt;",   4, '<'},
+        {"&gt;",   4, '>'},
+    };
+
     std::string output;
+    output.reserve(input.size());
 
-    output = std::regex_replace(input, std::regex("&quot;"), "\"");
-    output = std::regex_replace(output, std::regex("&apos;"), "\'");
-    output = std::regex_replace(output, std::regex("&lt;"), "<");
-    output = std::regex_replace(output, std::regex("&gt;"), ">");
-    output = std::regex_replace(output, std::regex("\\n"), "\n");
+    const char *data = input.data();
+    const char *end = data + input.size();
+    const char *start = data; // beginning of the current run of normal characters
+    const char *amp;
+    while ((amp = (const char *) memchr(start, '&', end - start)) != nullptr) {
+        output.append(start, amp - start);
+        start = amp + 1;
+        output.push_back('&');
+        for (const auto &e : entities) {
+            if ((size_t) (end - amp) >= e.length && memcmp(amp, e.entity, e.length) == 0) {
+                output.back() = e.c;
+                start = amp + e.length;
+                break;
+            }
+        }
+    }
+    output.append(start, end - start);
 
     return output;
 }
@@ -1,8 +1,10 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <array>
 #include <iostream>
 #include <fstream>
+#include <cstring>
 #include <regex>
 #include <string>
 
@@ -10,8 +12,8 @@ namespace utils {
 
 std::string ReadTextFile(std::string path);
 bool WriteTextFile(std::string contents, std::string path);
-std::string CleanStringForJS(std::string input);
-std::string CleanJSString(std::string input);
+std::string CleanStringForJS(const std::string &input);
+std::string CleanJSString(const std::string &input);
 
 }
 #endif // UTILS_H
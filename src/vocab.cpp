@@ -0,0 +1,84 @@
+#include "vocab.h"
+
+
+// copies the strings of all tokens from llama.cpp, called after the model has been loaded
+void Vocab::Build(llama_context *ctx) {
+    const int n_vocab = llama_n_vocab(ctx);
+    this->bytes.clear();
+    this->offsets.assign(1, 0);
+    this->offsets.reserve(n_vocab + 1);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        this->bytes += llama_token_to_str(ctx, id);
+        this->offsets.push_back((uint32_t) this->bytes.size());
+    }
+    this->bytes.shrink_to_fit();
+}
+
+
+// returns bytes of the token, empty for ids outside the vocabulary
+std::string_view Vocab::Get(llama_token id) const {
+    if (id < 0 || id >= this->Size())
+        return std::string_view();
+    return std::string_view(this->bytes.data() + this->offsets[id], this->offsets[id + 1] - this->offsets[id]);
+}
+
+
+int Vocab::Size(void) const {
+    return this->offsets.empty() ? 0 : (int) this->offsets.size() - 1;
+}
+
+
+std::string Utf8Assembler::Feed(std::string_view bytes) {
+    this->pending.append(bytes);
+
+    std::string out;
+    out.reserve(this->pending.size());
+    size_t i = 0;
+    while (i < this->pending.size()) {
+        unsigned char c = this->pending[i];
+        size_t length = 0; // 0 = not a valid first byte
+        if (c < 0x80)
+            length = 1;
+        else if (c >= 0xC2 && c < 0xE0)
+            length = 2;
+        else if (c >= 0xE0 && c < 0xF0)
+            length = 3;
+        else if (c >= 0xF0 && c < 0xF5)
+            length = 4;
+
+        // range of the second byte excludes overlong forms, surrogates and code points above U+10FFFF
+        unsigned char lo = 0x80, hi = 0xBF;
+        if (c == 0xE0)
+            lo = 0xA0;
+        else if (c == 0xED)
+            hi = 0x9F;
+        else if (c == 0xF0)
+            lo = 0x90;
+        else if (c == 0xF4)
+            hi = 0x8F;
+
+        size_t n = 1;
+        while (n < length && i + n < this->pending.size()) {
+            unsigned char next = this->pending[i + n];
+            if (n == 1 ? (next < lo || next > hi) : (next & 0xC0) != 0x80)
+                break;
+            n++;
+        }
+        if (length > 0 && n == length) {
+            out.append(this->pending, i, length);
+            i += length;
+        } else if (length > 0 && i + n == this->pending.size()) {
+            break; // rest of the character is in the next token
+        } else {
+            out += "\xEF\xBF\xBD";
+            i += n;
+        }
+    }
+    this->pending.erase(0, i);
+    return out;
+}
+
+
+void Utf8Assembler::Reset(void) {
+    this->pending.clear();
+}
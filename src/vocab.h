@@ -0,0 +1,43 @@
+#ifndef VOCAB_H
+#define VOCAB_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "llama.h"
+
+/**
+ * Bytes of every token of the vocabulary in a single buffer, built once when the model is
+ * loaded. Detokenizing is an index lookup which returns a view into the table, so the
+ * output path doesn't copy or look up token strings in llama.cpp.
+ */
+class Vocab {
+public:
+    void Build(llama_context *ctx);
+
+    std::string_view Get(llama_token id) const;
+    int Size(void) const;
+
+private:
+    std::string bytes; // all tokens back to back
+    std::vector<uint32_t> offsets; // token i is bytes[offsets[i], offsets[i + 1])
+};
+
+
+/**
+ * Joins the bytes of consecutive tokens into valid UTF-8. A character can be split over
+ * several tokens, its bytes are held back until the rest arrives. Invalid bytes are
+ * replaced with U+FFFD so that the UI always receives text it can decode.
+ */
+class Utf8Assembler {
+public:
+    std::string Feed(std::string_view bytes); // returns the complete characters received
+    void Reset(void); // drops a character which hasn't been completed
+
+private:
+    std::string pending;
+};
+
+#endif // VOCAB_H
@@ -8,9 +8,11 @@ namespace fs = std::filesystem;
  * @param ui_style selected UI style (e.g. default)
  * @param userscript_path path to scripts
  * @param avatar_path path to avatars
+ * @param flush_interval how often generated output is sent to the UI (ms)
  */ 
 Webview::Webview(wxWindow *parent, const std::string ui_dir, std::string ui_style,
-                 const std::string userscript_path, const std::string avatar_path) {
+                 const std::string userscript_path, const std::string avatar_path,
+                 int flush_interval) {
     
     wxFileSystem::AddHandler(new wxMemoryFSHandler);
     
@@ -24,11 +26,15 @@ Webview::Webview(wxWindow *parent, const std::string ui_dir, std::string ui_styl
     std::string url = "memory:index.html";
     this->browser = wxWebView::New(parent, wxID_ANY, url);
     browser->RegisterHandler(wxSharedPtr<wxWebViewHandler>(new wxWebViewFSHandler("memory")));
+    
+    this->channel = new TokenChannel(this->browser, flush_interval);
 }
 
 
 Webview::~Webview() {
-    
+    LOG_S(INFO) << "Token channel: " << this->channel->GetFlushCount() << " flushes, " <<
+        this->channel->GetByteCount() << " bytes";
+    delete this->channel;
 }
 
 
@@ -37,41 +43,55 @@ wxWebView *Webview::GetBrowser() {
 }
 
 
-// called by LLM code
-bool Webview::AddTokenToUI(std::string token) {
-    
-    // check if we are receiving input for previously started multi-byte character
-    if (this->input_left > 0) {
-        this->tmp_input.append(token);
-        this->input_left--;
-        
-        if (this->input_left == 0) { // send tmp_input to the UI
-            this->tmp_input = utils::CleanStringForJS(this->tmp_input);
-            
-            bool result = this->browser->RunScript("LLMOutput(\"" + wxString::FromUTF8(this->tmp_input) + "\");");
-            this->tmp_input = "";
-            return result;
-        } else { // still some input left
-            return true;
-        }
-    }
-    
-    // check for incoming multi-byte characters, first byte: 1110xxxx => 3-byte character
-    uint8_t c = token.at(0);
-    if (c >= 192)
-        this->input_left++;
-    if (c >= 224)
-        this->input_left++;
-    if (c >= 240)
-        this->input_left++;
-    if (this->input_left > 0) { // return since we are waiting for the rest of bytes
-        this->tmp_input.append(token);
-        return true;
+TokenChannel *Webview::GetChannel() {
+    return this->channel;
+}
+
+
+// called by LLM code, output is buffered and sent to the UI by the token channel
+// the model sends only complete UTF-8 characters
+bool Webview::AddTokenToUI(const std::string &token) {
+    this->channel->AddText(token);
+    return true;
+}
+
+
+// runs script in the UI after the output queued so far, can be called from any thread
+bool Webview::QueueScript(std::string script) {
+    this->channel->AddScript(script);
+    return true;
+}
+
+
+// TokenSink interface, called by the generation thread
+void Webview::OnOutput(int char_index, const std::string &text) {
+    this->AddTokenToUI(text);
+}
+
+
+void Webview::OnStateChange(int char_index, GenerationState state) {
+    switch (state) {
+    case GenerationState::Tokenizing:
+        this->QueueScript("tokenizing();");
+        break;
+    case GenerationState::Generating:
+        this->QueueScript("generating();");
+        break;
+    case GenerationState::Paused:
+        this->QueueScript("generationPaused();");
+        break;
+    case GenerationState::WaitingForInput:
+        this->QueueScript("waitingForInput()");
+        break;
+    case GenerationState::Stopped:
+        this->QueueScript("generationStopped();");
+        break;
     }
-    
-    token = utils::CleanStringForJS(token);
-    bool result = this->browser->RunScript("LLMOutput(\"" + wxString::FromUTF8(token) + "\");");
-    return result;
+}
+
+
+void Webview::OnReplyReplaced(int char_index, const std::string &text) {
+    this->QueueScript("replaceLastReply(\"" + utils::CleanStringForJS(text) + "\");");
 }
 
 
@@ -20,16 +20,26 @@
 
 #include "loguru.hpp"
 
+#include "tokenchannel.h"
+#include "tokensink.h"
 #include "utils.h"
 
-class Webview {
+class Webview : public TokenSink {
 public:
     explicit Webview(wxWindow *parent, const std::string ui_dir, const std::string ui_style,
-                     const std::string userscript_path, const std::string avatar_path);
+                     const std::string userscript_path, const std::string avatar_path,
+                     int flush_interval);
     ~Webview();
     
     wxWebView *GetBrowser(void);
-    bool AddTokenToUI(std::string token);
+    bool AddTokenToUI(const std::string &token);
+    bool QueueScript(std::string script);
+    
+    void OnOutput(int char_index, const std::string &text) override;
+    void OnStateChange(int char_index, GenerationState state) override;
+    void OnReplyReplaced(int char_index, const std::string &text) override;
+    
+    TokenChannel *GetChannel(void);
     bool LoadUIFiles(void);
     bool DeleteMemoryFiles(void);
 
@@ -37,6 +47,7 @@ private:
     bool CheckUIStyles(std::string path);
     bool LoadFiles(std::string path, bool root=false);
     wxWebView *browser;
+    TokenChannel *channel;
     
     std::string ui_dir;
     std::string ui_style;
@@ -45,8 +56,6 @@ private:
     inline static std::vector<std::string> ui_styles; // list of available UI styles
     inline static std::vector<std::string> ui_style_files; // list of files related to currently active style
     inline static std::vector<std::string> memory_files; // list of all files added to memory FS
-    std::string tmp_input;
-    int input_left = 0;
 };
 
 #endif // WEBVIEW_H
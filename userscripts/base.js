@@ -25,9 +25,7 @@ var old_model;
 
 var base_prompt = []; // base prompt
 var base_log = []; // initial messages from the log are stored here, separately for each char
-var last_log_index = []; // array of ints per char denoting when the char last outputted response
-var log = []; // all interactive conversations are logged here
-var tmplog; // incoming tokens go here
+// the conversation itself is stored by the backend, only new messages are sent to it
 
 var first_run = []; // wherever we are sending the first message to LLM
 var is_generating = false; // wherever we are currently generating
@@ -97,25 +95,15 @@ function waitingForInput() {
   is_generating = false;
   model_list.disabled = false;
   next_char_list.disabled = false;
-  
-  if (tmplog.length > 0) {
-    // check that tmplog correctly starts with the current char name
-    if (!tmplog.startsWith(params.char_names[current_char] + ":"))
-      tmplog = params.char_names[current_char] + ":" + tmplog;
-      
-    log.push([Date.now(), tmplog]);
-    tmplog="";
-  }
-  
-  // store index of the last reply of this char
-  last_log_index[current_char] = log.length;
-
 
   updateStatusbar('Reverse prompt found, waiting for input.');
 
   if (params.n_chars > 0)
     updateNextChar();
   
+  // other characters can process the reply while the next one is generating
+  prefillOthers(users_turn ? -1 : current_char);
+  
   if (!users_turn) {
     // call next char directly without waiting for user input
     model_list.disabled = true;
@@ -136,12 +124,6 @@ function generationStopped(time) {
   is_generating = false;
   model_list.disabled = false;
   next_char_list.disable = false;
-  
-  // add last message to the log
-  if (tmplog.length > 0) {
-    log.push([Date.now(), tmplog]);
-    tmplog = "";
-  }
 
   statusbar.textContent = "Finished generating...";
   // TODO: maybe add timings here
@@ -200,13 +182,12 @@ function stopGeneration() {
 // regenerates character's last reply
 function Regenerate() {
 
-  if (first_run[previous_char])
+  if (first_run[modelIndex(previous_char)])
     return;
 
-  // remove previous messagebox and entry from the log
+  // remove previous messagebox, the backend removes the reply from the conversation
   let last_messagebox = Array.from(document.querySelectorAll('.left-msg')).pop();
   chat_elem.removeChild(last_messagebox);
-  log.pop();
   
   current_char = previous_char;
 
@@ -222,6 +203,30 @@ function Regenerate() {
 }
 
 
+// shows previous (-1) or next (1) alternative of character's last reply
+function switchReply(direction) {
+
+  if (is_generating || first_run[modelIndex(previous_char)])
+    return;
+
+  let command = {};
+  command.cmd = "switch reply";
+  command.params = {};
+  command.params.char_index = previous_char;
+  command.params.direction = direction;
+  window.command.postMessage(command);
+}
+
+
+// used by LLM to replace the last reply after switching to another alternative
+function replaceLastReply(text) {
+  let last_messagebox = Array.from(document.querySelectorAll('.left-msg')).pop();
+  let text_field = last_messagebox.querySelector('.msg-text');
+  text_field.innerHTML = text.replaceAll("\n", "<br>");
+  chat_elem.scrollTop += 500;
+}
+
+
 function reloadParams() {
     let command = {};
     command.cmd = "get params";
@@ -247,8 +252,6 @@ function parseParams(new_params, show_ui = false) {
       first_run.push(true);
     if (base_log.length <= i)
       base_log[i] = [];
-    if (last_log_index.length <= i)
-      last_log_index.push(0);
   }
     
   if (!prompt_parsed) {
@@ -458,7 +461,7 @@ function updateNextChar() {
   }
 
   // user should get his turn if the char that hasn't replied yet
-  if (first_run[current_char]) 
+  if (first_run[modelIndex(current_char)]) 
     users_turn = true;
  
   updateStatusbar('Next char: ' + params.char_names[current_char]);
@@ -473,46 +476,45 @@ function updateNextCharPolicy(policy) {
 }
 
 
+// index of the model generating replies of the char, all chars share one model in shared context mode
+function modelIndex(char_index) {
+  return params.shared_context ? 0 : char_index;
+}
+
+
 // called by UI
-// if input_text == null, don't include "user:" + input to the LLM parameters
+// if input_text == null, the char continues without a message from the user
 function processUserInput(input_text) {
+  // the backend builds the prompt from the conversation, only the new message is sent
   let command = {};
-    
-  if (first_run[current_char]) {
-    command.cmd = "start generation";
-    command.params = {};
-    command.params.char_index = current_char; // which character is generating the reply
-    
-    if (input_text != null) {
-      command.params.prompt = base_prompt[current_char] + "\n" + base_log[current_char].join("\n") + "\n" +
-        params.user_name + ":" + input_text + "\n";
-    } else {
-      command.params.prompt = base_prompt[current_char] + "\n" + base_log[current_char].join("\n") + "\n";      
-    }
-    first_run[current_char] = false;
+  command.cmd = first_run[modelIndex(current_char)] ? "start generation" : "continue generation";
+  command.params = {};
+  command.params.char_index = current_char; // which character is generating the reply
+  command.params.input = input_text;
+  first_run[modelIndex(current_char)] = false;
+  
+  window.command.postMessage(command);
+  if (input_text != null)
+    prefillOthers(current_char);
+}
 
-  } else {
-    command.cmd = "continue generation";
-    command.params = {};
-    command.params.char_index = current_char;
-    
-    // since log contains timestamps, we want to get the second element of each log entry
-    if (input_text != null) {
-      command.params.input = log.slice(last_log_index[current_char]).map(function(e){return e[1];}).join("\n") + 
-                              params.user_name + ":" + input_text + "\n" + 
-                              params.char_names[current_char] + ":";
-    } else {
-      command.params.input = log.slice(last_log_index[current_char]).map(function(e){return e[1];}).join("\n") + 
-                              params.char_names[current_char] + ":";      
-    }
-  }
+
+// other characters evaluate the messages they haven't seen yet in the background, so that
+// the next speaker doesn't have to process them first
+function prefillOthers(except) {
+  if (params.shared_context)
+    return;
+  
+  for (var i = 0; i < params.n_chars; i++) {
+    if (i == except || first_run[i])
+      continue;
     
-  window.command.postMessage(command);
-  if (input_text != null) {
-    // also store timestamp in the log
-    log.push([Date.now(), params.user_name + ": " + input_text]);
+    let command = {};
+    command.cmd = "prefill";
+    command.params = {};
+    command.params.char_index = i;
+    window.command.postMessage(command);
   }
-  tmplog = "";
 }
 
 
@@ -601,6 +603,7 @@ function saveSettings() {
 // Parses prompt and populates base prompt and initial chat messages based on it
 function parsePrompt(prompt, char_index) {
   prompt_parsed = true;
+  base_log[char_index] = [];
   
   // replace {{char}} and {{user}} in the prompt
   prompt = prompt.replaceAll("{{char}}", params.char_names[char_index]);
@@ -640,14 +643,20 @@ function parsePrompt(prompt, char_index) {
   
   base_prompt_elem.innerHTML += "<b>" + params.char_names[char_index] + "</b>: " +
                                   base_prompt[char_index] + "<br>";
+  
+  // the backend builds prompts from these
+  let command = {};
+  command.cmd = "set base";
+  command.params = {};
+  command.params.char_index = char_index;
+  command.params.base_prompt = base_prompt[char_index];
+  command.params.base_log = base_log[char_index];
+  window.command.postMessage(command);
 }
 
 
 // called by LLM
 function LLMOutput(token) {
-  // update chat log
-  tmplog = tmplog + token;
-    
   // find last messagebox of AI and modify it's text field
   let last_messagebox = Array.from(document.querySelectorAll('.left-msg')).pop();
   let text_field = last_messagebox.querySelector('.msg-text');
@@ -655,20 +664,8 @@ function LLMOutput(token) {
   // replace \n in token with <br>
   token = token.replaceAll("\n", "<br>");
     
+  // antiprompts are removed by the backend before the output is sent here
   text_field.innerHTML = text_field.innerHTML + token;
-    
-  // check if last part of innerHTML matches with antiprompt + ":" and remove it
-  let antiprompt;
-  for (let i = 0; i < params.gpt_params[current_char].antiprompt.length; i++) {
-    antiprompt = params.gpt_params[current_char].antiprompt.at(i);
-
-    if (text_field.innerHTML.endsWith(antiprompt)) {
-      text_field.innerHTML = text_field.innerHTML.slice(0, -antiprompt.length);
-      // also remove it from tmplog
-      tmplog = tmplog.slice(0, -antiprompt.length);
-      break;
-    }
-  }
   
   updateStatusbar(params.char_names[current_char] + " is typing...");
   // check the same for AI name
@@ -679,16 +676,6 @@ function LLMOutput(token) {
 }
 
 
-// sends chatlog (with base prompt) to the backend
-function retrieveLog() {
-  tmp = {};
-  tmp["base_prompt"] = base_prompt;
-  tmp["base_log"] = base_log;
-  tmp["log"] = log;
-  return tmp;
-}
-
-
 // Utility functions
 function formatDate(date) {
   const hour = "0" + date.getHours();